@@ -0,0 +1,640 @@
+/*
+ * logwriter.c:
+ * Filtering rules and rotated logfiles, shared by rotatelogs and
+ * run-with-lockfile.
+ *
+ * Copyright (c) 2005 UK Citizens Online Democracy. All rights reserved.
+ * Email: chris@mysociety.org; WWW: http://www.mysociety.org/
+ *
+ */
+
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pcre.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "logwriter.h"
+
+const char *straction[] = {"pass", "passnoemail", "drop"};
+
+/* sized_buffer BUFFER BUFLEN NEED
+ * Make sure the *BUFLEN-byte *BUFFER has room for at least NEED bytes,
+ * growing it if not; returns *BUFFER. */
+char *sized_buffer(char **buf, size_t *buflen, const size_t need) {
+    if (!*buf || *buflen < need)
+        *buf = realloc(*buf, *buflen = need * 2);
+    return *buf;
+}
+
+/* trim_buffer BUFFER BUFLEN USED IDLE
+ * Note that USED bytes of the *BUFLEN-byte *BUFFER were needed this time, and
+ * shrink it to LINEBUF_KEEP bytes if it is larger and has been idle long
+ * enough; *IDLE counts the uses in a row which needed little of it. */
+void trim_buffer(char **buf, size_t *buflen, const size_t used, unsigned *idle) {
+    if (*buflen <= LINEBUF_KEEP || used > LINEBUF_KEEP / 2)
+        *idle = 0;
+    else if (++*idle >= LINEBUF_IDLE) {
+        *buf = realloc(*buf, *buflen = LINEBUF_KEEP);
+        *idle = 0;
+    }
+}
+
+/* getlogline STREAM LEN MAX MORE
+ * Read a line from STREAM. Returns a whole line ending '\n'; or, in case of
+ * error or EOF after reading at least one character, a partial line ending
+ * without a '\n'; or NULL. If LEN is not NULL, *LEN is set to the length of
+ * the whole line returned. If MAX is not zero, at most MAX bytes (not counting
+ * the '\n') are returned; if the line is longer than that, *MORE is set to
+ * true and the rest of it will be returned by subsequent calls. */
+unsigned char *getlogline(FILE *fp, size_t *len, const size_t max, bool *more) {
+    static char *buf;
+    static size_t buflen;
+    static unsigned idle;
+    size_t i;
+    int c;
+    sized_buffer(&buf, &buflen, 512);
+    if (!len) len = &i;
+    *len = 0;
+    if (more) *more = 0;
+    while (EOF != (c = getc(fp))) {
+        if ((*len + 1) >= buflen) buf = realloc(buf, buflen *= 2);
+        buf[(*len)++] = (unsigned char)c;
+        if (c == '\n') break;
+        if (max && *len == max) {
+            /* Don't count the newline against the limit. */
+            if ('\n' == (c = getc(fp))) {
+                if ((*len + 1) >= buflen) buf = realloc(buf, buflen *= 2);
+                buf[(*len)++] = (unsigned char)c;
+            }
+            else {
+                if (c != EOF) ungetc(c, fp);
+                if (more) *more = (c != EOF);
+            }
+            break;
+        }
+    }
+    buf[*len] = 0;  /* NUL-terminate, though the buffer may contain NULs */
+    /* Give back memory grown for unusually long lines once they stop. */
+    trim_buffer(&buf, &buflen, *len + 1, &idle);
+    if (*len == 0)
+        return NULL;
+    else
+        return (unsigned char *)buf;
+}
+
+/* rules_read FILENAME
+ * Read rules from FILENAME, returning a linked list of struct rule on success
+ * or NULL on failure. The list is in reverse order, so that the first element
+ * of the linked list is the last rule in the file. */
+struct rule *rules_read(const char *filename) {
+    FILE *fp;
+    struct rule *r;
+    char *line;
+    size_t l;
+    int linenum = 0;
+
+    if (!(fp = fopen(filename, "rt"))) {
+        our_error("%s: open: %s", filename, strerror(errno));
+        return NULL;
+    }
+
+    /* Always construct at least one rule, so that an empty rules file may be
+     * distinguished from a read error. */
+    r = malloc(sizeof *r);
+    r->r_action = act_pass;
+    r->r_regex = strdup("(none)");
+    r->r_pcre = NULL;
+    r->r_pcre_extra = NULL;
+    r->r_filename = strdup(filename);
+    fstat(fileno(fp), &r->r_st);    /* XXX we assume this succeeds */
+    r->r_next = NULL;
+    
+    while ((line = (char *)getlogline(fp, &l, 0, NULL))) {
+        char *keyword, *regex;
+        struct rule R = {0}, *pR;
+        const char *err;
+        int erroff;
+
+        ++linenum;
+
+        /* Remove any terminating \n. */
+        if (l > 0 && line[l - 1] == '\n') line[l - 1] = 0;
+        /* Skip blank/comment lines. */
+        if (!line[strspn(line, " \t")] || *line == '#') continue;
+
+        keyword = line + strspn(line, " \t");
+
+        /* Process an include file. */
+        if (0 == strncmp(keyword, "include", 7) && strchr(" \t", keyword[7])) {
+            /* XXX we ought to test for an include loop */
+            char *f;
+            struct rule *r2, *p;
+            f = keyword + 7;
+            f += strspn(f, " \t");
+            if (!*filename) {
+                our_error("%s:%d: missing filename after include", filename, linenum);
+                continue;
+            }
+            r2 = rules_read(f);
+            if (!r2) {
+                our_error("%s:%d: error reading included %s", filename, linenum, f);
+                continue;
+            }
+            /* Find end of new rules. */
+            for (p = r2; p->r_next; p = p->r_next);
+            p->r_next = r;
+            r = r2;
+            continue;
+        }
+        
+        for (R.r_action = 0; R.r_action < act_max; ++R.r_action) {
+            size_t n;
+            n = strlen(straction[R.r_action]);
+            if (0 == strncmp(keyword, straction[R.r_action], n)
+                && strchr(" \t", keyword[n])) {
+                regex = keyword + n;
+                regex += strspn(regex, " \t");
+                break;
+            }
+        }
+
+        if (R.r_action == act_max) {
+            our_error("%s:%d: syntax error (bad keyword); ignoring rule", filename, linenum);
+            continue;
+        }
+
+        if (!(R.r_pcre = pcre_compile(regex, 0, &err, &erroff, NULL))) {
+            our_error("%s:%d: error in regex: %s (near '%.5s', char %d); ignoring rule", filename, linenum, err, regex + erroff, 1 + erroff);
+            continue;
+        }
+
+        err = NULL;
+        R.r_pcre_extra = pcre_study(R.r_pcre, 0, &err);
+        if (err) {
+            our_error("%s:%d: error studying regex: %s; ignoring rule", filename, linenum, err);
+            pcre_free(R.r_pcre);
+            continue;
+        }
+
+        /* Success. */
+        R.r_regex = strdup(regex);
+        pR = malloc(sizeof *pR);
+        *pR = R;
+        pR->r_next = r;
+        r = pR;
+    }
+
+    if (ferror(fp)) {
+        our_error("%s:%d: %s", filename, linenum, strerror(errno));
+        rules_free(r);
+        r = NULL;
+    }
+
+    fclose(fp);
+
+    return r;
+}
+
+/* rules_free RULES
+ * Free a linked list of RULES. */
+void rules_free(struct rule *r) {
+    struct rule *rn;
+    while (r) {
+        rn = r->r_next;
+        free(r->r_regex);
+        if (r->r_pcre) pcre_free(r->r_pcre);
+        if (r->r_pcre_extra) pcre_free(r->r_pcre_extra);
+        if (r->r_filename) free(r->r_filename);
+        free(r);
+        r = rn;
+    }
+}
+
+/* rules_test RULES LINE LEN
+ * Test the LEN-byte log LINE against the RULES, returning the resulting
+ * action. */
+enum action rules_test(struct rule *r, const char *line, const size_t len) {
+    struct rule *p;
+    for (p = r; p; p = p->r_next) {
+        int rc;
+        /* Skip the placeholder rule rules_read makes for each file; one
+         * from an included file sits in the middle of the list. */
+        if (!p->r_pcre)
+            continue;
+        rc = pcre_exec(p->r_pcre, p->r_pcre_extra, line, (int)len, 0, 0, NULL, 0);
+        if (rc == 0)
+            return p->r_action;
+        else if (rc != PCRE_ERROR_NOMATCH)
+            our_error("pcre_exec(/%s/, ...) returned error value %d", p->r_regex, rc);
+    }
+    return act_pass;
+}
+
+/* parse_interval STRING
+ * Interpret STRING, which matches /^\s*\d+\s*[mhdw]/, as an interval. Returns
+ * the number of seconds in the interval on success, or 0 on failure. */
+time_t parse_interval(const char *s) {
+    const char *p;
+    time_t a;
+    p = s + strspn(s, " \t");
+    if (!isdigit(*p))
+        return 0;
+    a = (time_t)atoi(p);
+    p += strspn(p, "0123456789");
+    p += strspn(p, " \t");
+    if (*p) {
+        switch (tolower(*p)) {
+            case 'w':
+                a *= 7 * 24 * 3600;
+                break;
+
+            case 'd':
+                a *= 24 * 3600;
+                break;
+
+            case 'h':
+                a *= 3600;
+                break;
+
+            case 'm':
+                a *= 60;
+                break;
+
+            case 's':
+                break;
+    
+            default:
+                a = 0;
+                break;
+        }
+    } else 
+        a *= 1; /* assume seconds */
+    
+    return a;
+}
+
+/* parse_size STRING
+ * Interpret STRING, which matches /^\s*\d+\s*[kmg]?/, as a size in bytes.
+ * Returns the size on success, or 0 on failure. */
+off_t parse_size(const char *s) {
+    const char *p;
+    off_t a;
+    p = s + strspn(s, " \t");
+    if (!isdigit(*p))
+        return 0;
+    a = (off_t)atoll(p);
+    p += strspn(p, "0123456789");
+    p += strspn(p, " \t");
+    if (*p) {
+        switch (tolower(*p)) {
+            case 'g':
+                a *= 1024;
+                /* fall through */
+            case 'm':
+                a *= 1024;
+                /* fall through */
+            case 'k':
+                a *= 1024;
+                break;
+
+            default:
+                a = 0;
+                break;
+        }
+    }
+
+    return a;
+}
+
+/* rules_changed RULES
+ * Return true if any of the files from which RULES were read has changed
+ * since. */
+static bool rules_changed(struct rule *rules) {
+    struct rule *r;
+    for (r = rules; r; r = r->r_next) {
+        struct stat st;
+        if (!r->r_filename)
+            continue;
+        if (-1 == stat(r->r_filename, &st)
+            || st.st_size != r->r_st.st_size
+            || st.st_mtime != r->r_st.st_mtime
+            || st.st_ino != r->r_st.st_ino)
+            return 1;
+    }
+    return 0;
+}
+
+/* reread_rules RULES FILENAME
+ * If RULES is NULL, or if any of the files from which the rules were read have
+ * changed, then read FILENAME and return the new set of rules; otherwise,
+ * return RULES. */
+struct rule *reread_rules(struct rule *rules, const char *filename) {
+    struct rule *r;
+
+    if ((!rules || rules_changed(rules)) && (r = rules_read(filename))) {
+        rules_free(rules);
+        rules = r;
+    }
+
+    return rules;
+}
+
+
+/*
+ * Rules cache. A program which runs briefly can't afford to compile a large
+ * set of rules every time it starts, so rules_read_cached keeps the compiled
+ * rules in a file. Compiled PCRE patterns and their study data are blocks of
+ * memory without pointers, which may be saved and loaded again by the same
+ * version of the library. The cache records that version and the name of the
+ * rules file, then for each rule its action, regex, source file and that
+ * file's attributes, and the two blocks. Each item is a native size_t length
+ * followed by that many bytes.
+ *
+ * Since a corrupt compiled pattern can make PCRE misbehave, the cache is
+ * created readable and writable only by its owner, who is whoever logfiles
+ * would be made for, and a cache owned by anyone else, or writable by others,
+ * is ignored.
+ */
+#define RULES_CACHE_MAGIC   "logwriter rules cache 1"
+
+/* RULES_CACHE_MAX
+ * Largest item we'll believe a cache file to contain. */
+#define RULES_CACHE_MAX     (16 * 1024 * 1024)
+
+/* cache_write STREAM DATA LEN
+ * Write an item of LEN bytes of DATA to STREAM, returning true on success. */
+static bool cache_write(FILE *fp, const void *data, size_t len) {
+    return 1 == fwrite(&len, sizeof len, 1, fp)
+            && (len == 0 || 1 == fwrite(data, len, 1, fp));
+}
+
+/* cache_read STREAM LEN ALLOC HDR
+ * Read an item from STREAM into a block obtained from ALLOC, leaving HDR bytes
+ * before it and adding a NUL after it, and set *LEN, if LEN is not NULL, to
+ * its length. Returns the block, or NULL on error. */
+static char *cache_read(FILE *fp, size_t *len, void *(*alloc)(size_t), const size_t hdr) {
+    size_t l;
+    char *p;
+    if (1 != fread(&l, sizeof l, 1, fp) || l > RULES_CACHE_MAX
+        || !(p = alloc(hdr + l + 1)))
+        return NULL;
+    if (l > 0 && 1 != fread(p + hdr, l, 1, fp)) {
+        (alloc == malloc ? free : pcre_free)(p);
+        return NULL;
+    }
+    p[hdr + l] = 0;
+    if (len) *len = l;
+    return p;
+}
+
+/* cache_owner
+ * Return the user who should own a rules cache. */
+static uid_t cache_owner(void) {
+    return logfile_uid != (uid_t)-1 ? logfile_uid : geteuid();
+}
+
+/* rules_save RULES FILENAME CACHE
+ * Save RULES, read from FILENAME, to the file CACHE. */
+static void rules_save(struct rule *rules, const char *filename, const char *cache) {
+    struct rule *r;
+    FILE *fp;
+    char *tmp;
+    int fd;
+    bool ok;
+
+    tmp = malloc(strlen(cache) + 16);
+    sprintf(tmp, "%s.%d", cache, (int)getpid());
+    unlink(tmp);    /* left by an earlier process with our pid */
+    if (-1 == (fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600))) {
+        our_error("%s: open: %s", tmp, strerror(errno));
+        free(tmp);
+        return;
+    }
+    if ((-1 != logfile_uid || -1 != logfile_gid)
+        && -1 == fchown(fd, logfile_uid, logfile_gid)) {
+        our_error("%s: fchown(%d, %d): %s", tmp, logfile_uid, logfile_gid, strerror(errno));
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        return;
+    }
+    fp = fdopen(fd, "wb");
+
+    ok = cache_write(fp, RULES_CACHE_MAGIC, strlen(RULES_CACHE_MAGIC))
+         && cache_write(fp, pcre_version(), strlen(pcre_version()))
+         && cache_write(fp, filename, strlen(filename));
+    for (r = rules; ok && r; r = r->r_next) {
+        int32_t a = r->r_action;
+        size_t size = 0, studysize = 0;
+        if (r->r_pcre)
+            pcre_fullinfo(r->r_pcre, NULL, PCRE_INFO_SIZE, &size);
+        if (r->r_pcre_extra && (r->r_pcre_extra->flags & PCRE_EXTRA_STUDY_DATA))
+            pcre_fullinfo(r->r_pcre, r->r_pcre_extra, PCRE_INFO_STUDYSIZE, &studysize);
+        ok = 1 == fwrite(&a, sizeof a, 1, fp)
+             && cache_write(fp, r->r_regex, strlen(r->r_regex))
+             && cache_write(fp, r->r_filename, r->r_filename ? strlen(r->r_filename) : 0)
+             && (!r->r_filename || 1 == fwrite(&r->r_st, sizeof r->r_st, 1, fp))
+             && cache_write(fp, r->r_pcre, size)
+             && cache_write(fp, studysize ? r->r_pcre_extra->study_data : NULL, studysize);
+    }
+
+    if (EOF == fclose(fp))
+        ok = 0;
+    if (!ok || -1 == rename(tmp, cache)) {
+        our_error("%s: write: %s", tmp, strerror(errno));
+        unlink(tmp);
+    }
+    free(tmp);
+}
+
+/* rules_load FILENAME CACHE
+ * Load rules read from FILENAME from the file CACHE, returning them as
+ * rules_read would, or NULL if CACHE doesn't exist, can't be trusted, is for
+ * some other rules file or version of PCRE, or is out of date. */
+static struct rule *rules_load(const char *filename, const char *cache) {
+    struct rule *rules = NULL, **tail = &rules, *r;
+    FILE *fp;
+    struct stat st;
+    char *s;
+    int32_t a;
+    size_t len;
+    int fd;
+    bool ok;
+
+    if (-1 == (fd = open(cache, O_RDONLY | O_NOFOLLOW)))
+        return NULL;
+    if (-1 == fstat(fd, &st) || !S_ISREG(st.st_mode)
+        || st.st_uid != cache_owner() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        our_error("%s: not owned by uid %d or writable by others; ignoring it",
+                  cache, (int)cache_owner());
+        close(fd);
+        return NULL;
+    }
+    if (!(fp = fdopen(fd, "rb"))) {
+        close(fd);
+        return NULL;
+    }
+
+    ok = (s = cache_read(fp, NULL, malloc, 0)) && 0 == strcmp(s, RULES_CACHE_MAGIC);
+    free(s);
+    ok = ok && (s = cache_read(fp, NULL, malloc, 0)) && 0 == strcmp(s, pcre_version());
+    free(s);
+    ok = ok && (s = cache_read(fp, NULL, malloc, 0)) && 0 == strcmp(s, filename);
+    free(s);
+
+    while (ok && 1 == fread(&a, sizeof a, 1, fp)) {
+        pcre_extra *x;
+        *tail = r = calloc(1, sizeof *r);
+        tail = &r->r_next;
+        r->r_action = (enum action)a;
+        ok = a >= 0 && a < act_max
+             && (r->r_regex = cache_read(fp, NULL, malloc, 0))
+             && (s = cache_read(fp, &len, malloc, 0));
+        if (!ok)
+            break;
+        if (len) {
+            r->r_filename = s;
+            ok = 1 == fread(&r->r_st, sizeof r->r_st, 1, fp);
+        } else
+            free(s);
+        if (!ok || !(s = cache_read(fp, &len, pcre_malloc, 0))) {
+            ok = 0;
+            break;
+        } else if (len)
+            r->r_pcre = (pcre *)s;
+        else
+            pcre_free(s);
+        /* Study data follow a pcre_extra in the same block, as pcre_study
+         * would allocate them, so that pcre_free frees both. */
+        if (!(x = (pcre_extra *)cache_read(fp, &len, pcre_malloc, sizeof *x))) {
+            ok = 0;
+            break;
+        } else if (len) {
+            memset(x, 0, sizeof *x);
+            x->flags = PCRE_EXTRA_STUDY_DATA;
+            x->study_data = x + 1;
+            r->r_pcre_extra = x;
+        } else
+            pcre_free(x);
+    }
+
+    fclose(fp);
+    if (!ok || !rules || rules_changed(rules)) {
+        rules_free(rules);
+        return NULL;
+    }
+    return rules;
+}
+
+/* rules_read_cached FILENAME CACHE
+ * As rules_read, but take the rules from the file CACHE if it holds an up to
+ * date copy of them, and otherwise save them there. */
+struct rule *rules_read_cached(const char *filename, const char *cache) {
+    struct rule *r;
+    if ((r = rules_load(filename, cache)))
+        return r;
+    if ((r = rules_read(filename)))
+        rules_save(r, filename, cache);
+    return r;
+}
+
+int openflags = O_WRONLY | O_CREAT | O_APPEND;
+int logfile_mode = 0640;
+uid_t logfile_uid = -1;
+gid_t logfile_gid = -1;
+const char *logfile_name;
+bool (*logfile_symlink_hook)(const char *target, const char *tmp, const char *name);
+
+/* reopen_logfile FD INTERVAL NAME FORMAT TIME SYMLINK
+ * If the logfile open on FD should now be reopened under a new name because
+ * INTERVAL has passed, do so, using FORMAT as an argument to strftime to
+ * obtain a suffix added to NAME, and point logfile_name at the new name. If
+ * SYMLINK is true, create a symlink from NAME itself to the new file. Returns
+ * a file descriptor open on the new logfile, which the caller should use in
+ * place of FD, closing FD once it has finished with it; or FD if no new
+ * logfile is needed or it could not be opened. */
+int reopen_logfile(int fd, const time_t interval, const char *name, const char *format, time_t *t, const int make_symlink) {
+    time_t now;
+    struct tm T;
+    static char *buf, *buf2;
+    static size_t buflen;
+    int newfd;
+#define MAXTIMELEN 256
+    if (!buf) {
+        buf = malloc(buflen = strlen(name) + MAXTIMELEN + 1);
+        buf2 = malloc(strlen(name) + 64);
+    }
+
+    time(&now);
+    now -= now % interval;
+    /* Is the current logfile still valid? */
+    if (now == *t && fd != -1)
+        return fd;
+
+    localtime_r(&now, &T);
+    strcpy(buf, name);
+    strftime(buf + strlen(name), MAXTIMELEN, format, &T);
+
+    if (-1 == (newfd = open(buf, openflags, logfile_mode))) {
+        our_error("%s: open: %s", buf, strerror(errno));
+        return fd;
+    }
+    
+    /* Set the ownership of the new file. Note that there's a race here, but
+     * it's not very important. */
+    if ((-1 != logfile_uid || -1 != logfile_gid)
+        && -1 == fchown(newfd, logfile_uid, logfile_gid))
+        /* This is not a fatal error; report it, but do not abort. */
+        our_error("%s: fchown(%d, %d): %s", buf, logfile_uid, logfile_gid, strerror(errno));
+
+    *t = now;
+    logfile_name = buf;
+
+    if (make_symlink) {
+        /* We must construct a relative symlink, because we are not evil. */
+        char *basename;
+        basename = strrchr(buf, '/');
+        if (basename) basename++;
+        else basename = buf;
+
+        /* symlink(2) cannot be used to overwrite an existing file, so we must
+         * create a symlink under a new name and rename it over the old one. */
+again:
+        sprintf(buf2, "%s.%d.%d.%d", name, (int)getpid(), (int)time(NULL), rand());
+        /* The symlink's ownership must be set between the two steps, so
+         * that case is always done here. */
+        if (logfile_symlink_hook && -1 == logfile_uid && -1 == logfile_gid
+            && logfile_symlink_hook(basename, buf2, name))
+            return newfd;
+        if (-1 == symlink(basename, buf2)) {
+            if (errno == EEXIST)
+                goto again;
+            else
+                our_error("%s: symlink to %s: %s", buf2, basename, strerror(errno));
+        }
+        
+        /* We should also set the ownership of the symlink. */
+        if ((-1 != logfile_uid || -1 != logfile_gid)
+            && -1 == lchown(buf2, logfile_uid, logfile_gid))
+            /* Again, not a fatal error. */
+            our_error("%s: lchown(%d, %d): %s", buf2, logfile_uid, logfile_gid, strerror(errno));
+        
+        if (-1 == rename(buf2, name)) {
+            our_error("%s: rename to %s: %s", buf2, name, strerror(errno));
+            unlink(buf2);
+        }
+    }
+
+    return newfd;
+}
@@ -0,0 +1,79 @@
+/*
+ * logwriter.h:
+ * Filtering rules and rotated logfiles, shared by rotatelogs and
+ * run-with-lockfile.
+ *
+ * Copyright (c) 2005 UK Citizens Online Democracy. All rights reserved.
+ * Email: chris@mysociety.org; WWW: http://www.mysociety.org/
+ *
+ */
+
+#ifndef __LOGWRITER_H_ /* include guard */
+#define __LOGWRITER_H_
+
+#include <sys/types.h>
+
+#include <pcre.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+/* LINEBUF_KEEP, LINEBUF_IDLE
+ * Line buffers which have grown beyond LINEBUF_KEEP bytes to hold unusually
+ * long lines are shrunk back to that size once LINEBUF_IDLE lines in a row
+ * have needed no more than half of it. */
+#define LINEBUF_KEEP 65536
+#define LINEBUF_IDLE 1000
+
+enum action { act_pass = 0, act_passnoemail, act_drop, act_max };
+extern const char *straction[];
+
+/* struct rule
+ * Regex-based rule for logfile filtering. */
+struct rule {
+    enum action r_action;
+    char *r_regex;
+    pcre *r_pcre;
+    pcre_extra *r_pcre_extra;
+    /* record the file from which the rules came, and its attributes, so we
+     * know when to re-read them. */
+    char *r_filename;
+    struct stat r_st;
+    struct rule *r_next;
+};
+
+/* our_error FORMAT ...
+ * Report a printf-style error message; supplied by the program. */
+void our_error(const char *fmt, ...);
+
+char *sized_buffer(char **buf, size_t *buflen, const size_t need);
+void trim_buffer(char **buf, size_t *buflen, const size_t used, unsigned *idle);
+unsigned char *getlogline(FILE *fp, size_t *len, const size_t max, bool *more);
+
+struct rule *rules_read(const char *filename);
+struct rule *rules_read_cached(const char *filename, const char *cache);
+struct rule *reread_rules(struct rule *rules, const char *filename);
+void rules_free(struct rule *r);
+enum action rules_test(struct rule *r, const char *line, const size_t len);
+
+time_t parse_interval(const char *s);
+off_t parse_size(const char *s);
+
+/* Flags, mode and ownership given to new logfiles. */
+extern int openflags;
+extern int logfile_mode;
+extern uid_t logfile_uid;
+extern gid_t logfile_gid;
+
+/* Name of the logfile last opened by reopen_logfile. */
+extern const char *logfile_name;
+
+/* If set, called by reopen_logfile to create a symlink TMP pointing to TARGET
+ * and rename it over NAME in some other way, returning false if it can't. */
+extern bool (*logfile_symlink_hook)(const char *target, const char *tmp, const char *name);
+
+int reopen_logfile(int fd, const time_t interval, const char *name, const char *format, time_t *t, const int make_symlink);
+
+#endif /* __LOGWRITER_H_ */
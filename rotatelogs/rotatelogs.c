@@ -9,16 +9,22 @@
 
 static const char rcsid[] = "$Id: rotatelogs.c,v 1.10 2011-07-04 08:02:37 matthew Exp $";
 
+#define _GNU_SOURCE     /* for strptime, splice */
+
 #include <sys/types.h>
 
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <grp.h>
-#include <pcre.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,23 +33,52 @@ static const char rcsid[] = "$Id: rotatelogs.c,v 1.10 2011-07-04 08:02:37 matthe
 #include <unistd.h>
 
 #include <sys/fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 
+#include <arpa/inet.h>
+
+#include "logwriter.h"
+
+#ifdef USE_IO_URING
+#   include <linux/io_uring.h>
+#endif
+
 int logfile_fd = -1;
 
+/* logfile_indirect
+ * True if the logfile is not written by ordinary write(2)s to logfile_fd, so
+ * that messages written there directly would land out of order with the log
+ * lines, or on top of them. */
+static bool logfile_indirect;
+
+/* main_thread
+ * The thread running main, which alone opens and closes logfiles. */
+static pthread_t main_thread;
+
 /* our_error FORMAT ...
  * Log a printf-style message to the logfile, or standard error if the logfile
- * is not open. */
+ * is not open or is being written some other way. Messages from background
+ * threads always go to standard error, since the main thread may close the
+ * logfile under them. */
 void our_error(const char *fmt, ...) {
     va_list ap;
     int fd, n;
     char buf[4096];
     
-    fd = logfile_fd == -1 ? 2 : logfile_fd;
+    fd = logfile_fd == -1 || logfile_indirect
+         || !pthread_equal(pthread_self(), main_thread) ? 2 : logfile_fd;
 
     va_start(ap, fmt);
-    n = vsnprintf(buf, (sizeof buf) - 2, fmt, ap);
+    n = vsnprintf(buf, (sizeof buf) - 1, fmt, ap);
+    va_end(ap);
+    if (n > (int)(sizeof buf) - 2)
+        n = (sizeof buf) - 2;   /* truncated */
     buf[n++] = '\n';
 
     if (fd == 2) write(2, "rotatelogs: ", 12);
@@ -51,29 +86,15 @@ void our_error(const char *fmt, ...) {
     write(fd, buf, n);
 }
 
-/* getlogline STREAM LEN
- * Read a line from STREAM. Returns a whole line ending '\n'; or, in case of
- * error or EOF after reading at least one character, a partial line ending
- * without a '\n'; or NULL. If LEN is not NULL, *LEN is set to the length of
- * the whole line returned. */
-static unsigned char *getlogline(FILE *fp, size_t *len) {
-    static unsigned char *buf;
-    static size_t buflen;
-    size_t i;
+/* skip_line STREAM
+ * Read and discard the rest of a line from STREAM, returning the number of
+ * bytes discarded, not counting the '\n'. */
+static size_t skip_line(FILE *fp) {
+    size_t n = 0;
     int c;
-    if (!buf) buf = malloc(buflen = 1024);
-    if (!len) len = &i;
-    *len = 0;
-    while (EOF != (c = fgetc(fp))) {
-        if ((*len + 1) >= buflen) buf = realloc(buf, buflen *= 2);
-        buf[(*len)++] = (unsigned char)c;
-        if (c == '\n') break;
-    }
-    buf[*len] = 0;  /* NUL-terminate, though the buffer may contain NULs */
-    if (*len == 0)
-        return NULL;
-    else
-        return buf;
+    while (EOF != (c = getc(fp)) && c != '\n')
+        ++n;
+    return n;
 }
 
 /* usage STREAM
@@ -103,6 +124,26 @@ void usage(FILE *fp) {
 "\n"
 "    -s          Open logfiles O_SYNC, so that changes are forced out to disk.\n"
 "\n"
+"    -u          Write logfiles using io_uring(7) where the kernel supports\n"
+"                it, so that a slow disk doesn't hold up reading log lines.\n"
+"                With -s, each write is followed by an fdatasync(2).\n"
+"                Messages from rotatelogs itself then go to standard error\n"
+"                rather than the logfile.\n"
+"\n"
+"    -S          If standard input is a pipe, move data from it to the logfile\n"
+"                with splice(2); see below.\n"
+"\n"
+"    -M          Write logfiles through a memory mapping, preallocating space\n"
+"                for each new logfile; see below. Messages from rotatelogs\n"
+"                itself then go to standard error.\n"
+"\n"
+"    -p SIZE     With -M, preallocate SIZE bytes for the first logfile (later\n"
+"                ones get the size of the one before). The default is 16M.\n"
+"\n"
+"    -x          Escape control characters and non-ASCII bytes in lines\n"
+"                written to the logfile, as is done for emailed lines, so that\n"
+"                logs may safely be viewed on a terminal.\n"
+"\n"
 "    -f FORMAT   Use the strftime(3) FORMAT for the suffix on logfile names,\n"
 "                rather than '.' followed by the number of seconds since the\n"
 "                epoch.\n"
@@ -113,6 +154,35 @@ void usage(FILE *fp) {
 "                This limit is applied only for a single rotatelogs process;\n"
 "                the default is 30 minutes.\n"
 "\n"
+"    -D          Instead of emailing the first logged line and any which\n"
+"                follow it within a few seconds, count the lines logged\n"
+"                during each email INTERVAL, grouping lines which differ only\n"
+"                in their digits, and at the end of it send a single email\n"
+"                listing each group with its count, first and last times and\n"
+"                some example lines.\n"
+"\n"
+"    -F DEST     Also send lines written to the logfile to a collector at\n"
+"                DEST, which may be 'unix:PATH' or 'unixgram:PATH' for a\n"
+"                unix-domain stream or datagram socket, or 'tcp:HOST:PORT'.\n"
+"                Lines are sent in batches by a separate thread, so that an\n"
+"                unavailable collector can't hold up logging; up to 1MB is\n"
+"                buffered while reconnecting, after which lines are dropped.\n"
+"\n"
+"    -L          With -F, send each line preceded by its length as a 4-byte\n"
+"                big-endian integer, and without its newline, rather than\n"
+"                newline-terminated.\n"
+"\n"
+"    -n LENGTH   Treat lines longer than LENGTH bytes (which may have a\n"
+"                suffix 'k' or 'M') as described by -N, rather than reading\n"
+"                each line into memory however long it is.\n"
+"\n"
+"    -N POLICY   What to do with lines longer than the -n LENGTH: 'truncate'\n"
+"                (the default) to discard the rest of the line and add a note\n"
+"                of how many bytes were discarded; 'split' to treat each\n"
+"                LENGTH bytes of it as a separate line; or 'stream' to write\n"
+"                the whole line to the logfile as it is read, filtered and\n"
+"                emailed according to its first LENGTH bytes.\n"
+"\n"
 "    -r RULES    Read the given file of RULES and use them to filter lines to\n"
 "                be written to the log and/or emailed.\n"
 "\n"
@@ -125,6 +195,38 @@ void usage(FILE *fp) {
 "                rotatelogs process has sufficient privilege to change the\n"
 "                file ownership as required.\n"
 "\n"
+"    -k COUNT    Keep at most COUNT logfiles for NAME, deleting the oldest.\n"
+"\n"
+"    -a AGE      Delete logfiles for NAME which were last modified more than\n"
+"                AGE ago; AGE is given in the same form as INTERVAL.\n"
+"\n"
+"    -b SIZE     Keep at most SIZE bytes of logfiles for NAME, deleting the\n"
+"                oldest. SIZE may have a suffix 'k', 'M' or 'G'.\n"
+"\n"
+"Old logfiles are found by looking once, at startup, for files in the\n"
+"directory of NAME whose names begin with NAME; after that, only files\n"
+"created by this process are considered. The current logfile is never\n"
+"deleted. Deletion is done slowly by a low-priority background thread after\n"
+"each rotation.\n"
+"\n"
+"With -M, space is preallocated with fallocate(2) so the logfile's size will\n"
+"include zeroes beyond the data actually logged. The length of the real data\n"
+"is kept, as an 8-byte native-endian integer, in a file named after the\n"
+"logfile with '.hwm' appended; readers should not read beyond it. When the\n"
+"logfile is rotated, or at end of input, it is truncated to its real length\n"
+"and the .hwm file removed. If rotatelogs is killed, the .hwm file remains;\n"
+"at startup, any .hwm files left for NAME are used to truncate their\n"
+"logfiles, and removed. Since anything appended beyond the preallocated space\n"
+"would be lost, nothing else may write a logfile while it is mapped.\n"
+"\n"
+"With -S, if standard input is a pipe and none of -e, -r, -x, -u, -M, -F or\n"
+"-n is given, data are moved from it to the logfile with splice(2), without\n"
+"being copied through rotatelogs; a partial line is still completed before\n"
+"the logfile is rotated. Since splice(2) can't append, the logfile is then\n"
+"written at the offset where rotatelogs found its end, so nothing else may\n"
+"write to it at the same time, or lines will be overwritten; and it must be\n"
+"readable as well as writable.\n"
+"\n"
 "If -r is specified, it should give the name of a file of RULES which will be\n"
 "used to filter log lines to be written to the log and/or emailed. Each line\n"
 "in the file should be blank, a comment introduced by '#', the word 'include'\n"
@@ -154,325 +256,926 @@ void usage(FILE *fp) {
             rcsid);
 }
 
-enum action { act_pass = 0, act_passnoemail, act_drop, act_max };
-const char *straction[] = {"pass", "passnoemail", "drop"};
-
-/* struct rule
- * Regex-based rule for logfile filtering. */
-struct rule {
-    enum action r_action;
-    char *r_regex;
-    pcre *r_pcre;
-    pcre_extra *r_pcre_extra;
-    /* record the file from which the rules came, and its attributes, so we
-     * know when to re-read them. */
-    char *r_filename;
-    struct stat r_st;
-    struct rule *r_next;
+/* RETENTION_DELETE_DELAY
+ * Number of milliseconds the retention thread waits after deleting each old
+ * logfile, so that it doesn't compete with writes to the current one. */
+#define RETENTION_DELETE_DELAY 250
+
+/* struct retained
+ * An old logfile which the retention thread knows about. */
+struct retained {
+    char *rt_name;
+    time_t rt_mtime;
+    off_t rt_size;      /* -1 until the file has been rotated out */
 };
 
-void rules_free(struct rule *r);
+/* Retention policy set from the command line; zero means no limit. */
+static int retain_count;
+static time_t retain_age;
+static off_t retain_bytes;
+
+/* Known logfiles, oldest first; the last one is the current logfile. These
+ * and retain_pending are protected by retain_mutex. */
+static struct retained *retained;
+static size_t nretained, retainedlen;
+static bool retain_pending, retain_running;
+static pthread_mutex_t retain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t retain_cond = PTHREAD_COND_INITIALIZER;
+
+/* retained_add FILENAME MTIME SIZE
+ * Add FILENAME to the end of the list of known logfiles, moving it there if
+ * it is already present, with the given MTIME and SIZE. Call with
+ * retain_mutex held. */
+static void retained_add(const char *filename, time_t mtime, off_t size) {
+    size_t i;
+    for (i = 0; i < nretained; ++i) {
+        if (0 == strcmp(retained[i].rt_name, filename)) {
+            struct retained R = retained[i];
+            /* It may be the current logfile again (for instance, one found
+             * at startup which we are appending to), in which case its size
+             * must be looked at afresh when it is rotated out. */
+            R.rt_mtime = mtime;
+            R.rt_size = size;
+            memmove(retained + i, retained + i + 1, (nretained - i - 1) * sizeof *retained);
+            retained[nretained - 1] = R;
+            return;
+        }
+    }
+    if (nretained == retainedlen)
+        retained = realloc(retained, (retainedlen = retainedlen ? retainedlen * 2 : 16) * sizeof *retained);
+    retained[nretained].rt_name = strdup(filename);
+    retained[nretained].rt_mtime = mtime;
+    retained[nretained].rt_size = size;
+    ++nretained;
+}
 
-/* rules_read FILENAME
- * Read rules from FILENAME, returning a linked list of struct rule on success
- * or NULL on failure. The list is in reverse order, so that the first element
- * of the linked list is the last rule in the file. */
-struct rule *rules_read(const char *filename) {
-    FILE *fp;
-    struct rule *r;
-    char *line;
-    size_t l;
-    int linenum = 0;
+static int retained_compare(const void *a, const void *b) {
+    const struct retained *A = a, *B = b;
+    return A->rt_mtime < B->rt_mtime ? -1 : A->rt_mtime > B->rt_mtime;
+}
 
-    if (!(fp = fopen(filename, "rt"))) {
-        our_error("%s: open: %s", filename, strerror(errno));
-        return NULL;
+/* retention_scan NAME FORMAT
+ * Look once in the directory of NAME for existing logfiles, that is regular
+ * files whose names are NAME followed by a suffix generated from FORMAT, and
+ * record them, oldest first. */
+static void retention_scan(const char *name, const char *format) {
+    const char *base;
+    char *dir, *path;
+    size_t dirlen, baselen;
+    DIR *d;
+    struct dirent *de;
+    size_t first;
+
+    base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+    baselen = strlen(base);
+    dirlen = base - name;
+    dir = dirlen ? strndup(name, dirlen) : strdup(".");
+
+    if (!(d = opendir(dir))) {
+        our_error("%s: opendir: %s", dir, strerror(errno));
+        free(dir);
+        return;
     }
 
-    /* Always construct at least one rule, so that an empty rules file may be
-     * distinguished from a read error. */
-    r = malloc(sizeof *r);
-    r->r_action = act_pass;
-    r->r_regex = strdup("(none)");
-    r->r_pcre = NULL;
-    r->r_pcre_extra = NULL;
-    r->r_filename = strdup(filename);
-    fstat(fileno(fp), &r->r_st);    /* XXX we assume this succeeds */
-    r->r_next = NULL;
-    
-    while ((line = getlogline(fp, &l))) {
-        char *keyword, *regex;
-        struct rule R = {0}, *pR;
-        const char *err;
-        int erroff;
-
-        ++linenum;
-
-        /* Remove any terminating \n. */
-        if (l > 0 && line[l - 1] == '\n') line[l - 1] = 0;
-        /* Skip blank/comment lines. */
-        if (!line[strspn(line, " \t")] || *line == '#') continue;
-
-        keyword = line + strspn(line, " \t");
-
-        /* Process an include file. */
-        if (0 == strncmp(keyword, "include", 7) && strchr(" \t", keyword[7])) {
-            /* XXX we ought to test for an include loop */
-            char *f;
-            struct rule *r2, *p;
-            f = keyword + 7;
-            f += strspn(f, " \t");
-            if (!*filename) {
-                our_error("%s:%d: missing filename after include", filename, linenum);
-                continue;
-            }
-            r2 = rules_read(f);
-            if (!r2) {
-                our_error("%s:%d: error reading included %s", filename, linenum, f);
-                continue;
-            }
-            /* Find end of new rules. */
-            for (p = r2; p->r_next; p = p->r_next);
-            p->r_next = r;
-            r = r2;
+    first = nretained;
+    path = malloc(dirlen + 256 + 1);
+    while ((de = readdir(d))) {
+        struct stat st;
+        struct tm T = {0};
+        const char *end;
+        if (strncmp(de->d_name, base, baselen) || !de->d_name[baselen]
+            || strlen(de->d_name) > 255)
             continue;
-        }
-        
-        for (R.r_action = 0; R.r_action < act_max; ++R.r_action) {
-            size_t n;
-            n = strlen(straction[R.r_action]);
-            if (0 == strncmp(keyword, straction[R.r_action], n)
-                && strchr(" \t", keyword[n])) {
-                regex = keyword + n;
-                regex += strspn(regex, " \t");
-                break;
+        /* Only accept suffixes which FORMAT could have generated. */
+        if (!(end = strptime(de->d_name + baselen, format, &T)) || *end)
+            continue;
+        memcpy(path, name, dirlen);
+        strcpy(path + dirlen, de->d_name);
+        if (-1 == lstat(path, &st) || !S_ISREG(st.st_mode))
+            continue;
+        retained_add(path, st.st_mtime, st.st_size);
+    }
+    closedir(d);
+    free(path);
+    free(dir);
+
+    qsort(retained + first, nretained - first, sizeof *retained, retained_compare);
+}
+
+/* retention_thread ARG
+ * Background thread which, whenever woken, deletes old logfiles exceeding
+ * the retention policy, pausing between deletions. */
+static void *retention_thread(void *arg) {
+    pid_t tid;
+    struct retained *victims = NULL;
+    size_t nvictims, victimslen = 0;
+
+    /* On Linux these apply to the calling thread only. */
+    tid = (pid_t)syscall(SYS_gettid);
+    setpriority(PRIO_PROCESS, tid, 19);
+#ifdef SYS_ioprio_set
+#   define IOPRIO_WHO_PROCESS  1
+#   define IOPRIO_CLASS_IDLE   3
+#   define IOPRIO_CLASS_SHIFT  13
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#endif
+
+    pthread_mutex_lock(&retain_mutex);
+    while (1) {
+        size_t i, n;
+        off_t total = 0;
+        time_t now;
+
+        while (!retain_pending)
+            pthread_cond_wait(&retain_cond, &retain_mutex);
+        retain_pending = 0;
+
+        /* Files which have been rotated out won't change any more, so we
+         * need only stat them once. */
+        for (i = 0; i + 1 < nretained; ++i) {
+            if (retained[i].rt_size == -1) {
+                struct stat st;
+                if (-1 == stat(retained[i].rt_name, &st))
+                    retained[i].rt_size = 0;
+                else {
+                    retained[i].rt_size = st.st_size;
+                    retained[i].rt_mtime = st.st_mtime;
+                }
             }
+            total += retained[i].rt_size;
         }
 
-        if (R.r_action == act_max) {
-            our_error("%s:%d: syntax error (bad keyword); ignoring rule", filename, linenum);
-            continue;
+        /* Pick victims from the oldest end, never the current logfile. */
+        time(&now);
+        n = nretained;
+        for (i = 0; i + 1 < nretained; ++i) {
+            if ((retain_count && n > (size_t)retain_count)
+                || (retain_age && retained[i].rt_mtime < now - retain_age)
+                || (retain_bytes && total > retain_bytes)) {
+                --n;
+                total -= retained[i].rt_size;
+            } else
+                break;
         }
-
-        if (!(R.r_pcre = pcre_compile(regex, 0, &err, &erroff, NULL))) {
-            our_error("%s:%d: error in regex: %s (near '%.5s', char %d); ignoring rule", filename, linenum, err, regex + erroff, 1 + erroff);
-            continue;
+        nvictims = i;
+        if (nvictims > victimslen)
+            victims = realloc(victims, (victimslen = nvictims) * sizeof *victims);
+        memcpy(victims, retained, nvictims * sizeof *victims);
+        memmove(retained, retained + nvictims, (nretained - nvictims) * sizeof *retained);
+        nretained -= nvictims;
+
+        pthread_mutex_unlock(&retain_mutex);
+        for (i = 0; i < nvictims; ++i) {
+            struct timespec ts = { 0, RETENTION_DELETE_DELAY * 1000000L };
+            if (-1 == unlink(victims[i].rt_name) && errno != ENOENT)
+                our_error("%s: unlink: %s", victims[i].rt_name, strerror(errno));
+            free(victims[i].rt_name);
+            nanosleep(&ts, NULL);
         }
+        pthread_mutex_lock(&retain_mutex);
+    }
 
-        err = NULL;
-        R.r_pcre_extra = pcre_study(R.r_pcre, 0, &err);
-        if (err) {
-            our_error("%s:%d: error studying regex: %s; ignoring rule", filename, linenum, err);
-            pcre_free(R.r_pcre);
-            continue;
-        }
+    return NULL;
+}
+
+/* retention_start NAME FORMAT
+ * If any retention policy has been set, find existing logfiles for NAME and
+ * start the retention thread. */
+static void retention_start(const char *name, const char *format) {
+    pthread_t th;
+    pthread_attr_t attr;
+    int e;
+
+    if (!retain_count && !retain_age && !retain_bytes)
+        return;
+
+    retention_scan(name, format);
+    retain_pending = 1;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if ((e = pthread_create(&th, &attr, retention_thread, NULL)))
+        our_error("pthread_create: %s", strerror(e));
+    else
+        retain_running = 1;
+    pthread_attr_destroy(&attr);
+}
+
+/* retention_add FILENAME
+ * Record that FILENAME is now the current logfile, and wake the retention
+ * thread to apply the policy. */
+static void retention_add(const char *filename) {
+    if (!retain_running)
+        return;
+    pthread_mutex_lock(&retain_mutex);
+    retained_add(filename, time(NULL), -1);
+    retain_pending = 1;
+    pthread_cond_signal(&retain_cond);
+    pthread_mutex_unlock(&retain_mutex);
+}
+
+#ifdef USE_IO_URING
+/*
+ * Optional io_uring backend. Log lines are gathered into a small pool of
+ * buffers, each of which is written by a single asynchronous write request
+ * (followed, with -s, by a linked fdatasync). The logfile stays O_APPEND, so
+ * that other processes may still write to it; to keep our own writes in
+ * order, buffers filled while earlier writes are in flight are held back, and
+ * then submitted together as one chain of linked requests. Closing the old
+ * logfile once its writes are done, and replacing the symlink, are also done
+ * asynchronously; open(2) and fchown(2) are not, since we need their results
+ * straight away.
+ */
 
-        /* Success. */
-        R.r_regex = strdup(regex);
-        pR = malloc(sizeof *pR);
-        *pR = R;
-        pR->r_next = r;
-        r = pR;
+/* URING_ENTRIES, URING_NBUFS, URING_BUFSIZE
+ * Size of the submission queue, and number and size of write buffers. */
+#define URING_ENTRIES   64
+#define URING_NBUFS     16
+#define URING_BUFSIZE   65536
+
+/* Values of user_data for requests other than writes, which use the index of
+ * their buffer. */
+enum { ud_fsync = URING_NBUFS, ud_close, ud_symlink, ud_rename };
+
+/* struct uring
+ * An io_uring instance and its write buffers. */
+struct uring {
+    int u_fd;
+    unsigned *u_sq_head, *u_sq_tail, *u_sq_mask, *u_sq_array;
+    unsigned *u_cq_head, *u_cq_tail, *u_cq_mask;
+    struct io_uring_sqe *u_sqes;
+    struct io_uring_cqe *u_cqes;
+    unsigned u_sq_entries, u_to_submit, u_inflight;
+    bool u_datasync, u_can_link;
+    struct {
+        char *b_data;
+        size_t b_len;
+        int b_fd;
+        enum { buf_free, buf_queued, buf_writing } b_state;
+    } u_bufs[URING_NBUFS];
+    int u_cur;              /* buffer being filled */
+    int u_next;             /* oldest buffer queued but not yet submitted */
+    unsigned u_writing;     /* writes in flight */
+    bool u_submitting;
+    char *u_link_tmp;       /* temporary symlink name being renamed */
+    bool u_link_made;       /* whether it has been created */
+};
+
+static struct uring *ring;
+
+/* ring_setup DATASYNC
+ * Create an io_uring and check that the kernel supports the operations we
+ * need. If DATASYNC is true, each write will be followed by an fdatasync.
+ * Returns the new ring, or NULL if io_uring can't be used. */
+static struct uring *ring_setup(const bool datasync) {
+    struct io_uring_params p = {0};
+    struct io_uring_probe *probe;
+    struct uring *u;
+    char *sq, *cq;
+    size_t sqlen, cqlen;
+    int fd, i;
+
+    if (-1 == (fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p)))
+        return NULL;
+
+    probe = calloc(1, sizeof *probe + IORING_OP_LAST * sizeof probe->ops[0]);
+    if (-1 == syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST)
+        || probe->last_op < IORING_OP_CLOSE
+        || !(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED)
+        || !(probe->ops[IORING_OP_FSYNC].flags & IO_URING_OP_SUPPORTED)
+        || !(probe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED)
+        || !(p.features & IORING_FEAT_NODROP)
+        || !(p.features & IORING_FEAT_RW_CUR_POS)) {
+        free(probe);
+        close(fd);
+        return NULL;
     }
 
-    if (ferror(fp)) {
-        our_error("%s:%d: %s", filename, linenum, strerror(errno));
-        rules_free(r);
-        r = NULL;
+    u = calloc(1, sizeof *u);
+    u->u_fd = fd;
+    u->u_datasync = datasync;
+    u->u_can_link = probe->last_op >= IORING_OP_SYMLINKAT
+                    && (probe->ops[IORING_OP_SYMLINKAT].flags & IO_URING_OP_SUPPORTED)
+                    && (probe->ops[IORING_OP_RENAMEAT].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+
+    sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqlen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    sq = mmap(NULL, sqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cq = mmap(NULL, cqlen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    u->u_sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || u->u_sqes == MAP_FAILED) {
+        our_error("io_uring: mmap: %s", strerror(errno));
+        close(fd);
+        free(u);
+        return NULL;
     }
 
-    fclose(fp);
+    u->u_sq_head  = (unsigned *)(sq + p.sq_off.head);
+    u->u_sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    u->u_sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->u_sq_array = (unsigned *)(sq + p.sq_off.array);
+    u->u_cq_head  = (unsigned *)(cq + p.cq_off.head);
+    u->u_cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    u->u_cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->u_cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    u->u_sq_entries = p.sq_entries;
+
+    for (i = 0; i < URING_NBUFS; ++i) {
+        u->u_bufs[i].b_data = malloc(URING_BUFSIZE);
+        u->u_bufs[i].b_fd = -1;
+    }
 
-    return r;
+    return u;
 }
 
-/* rules_free RULES
- * Free a linked list of RULES. */
-void rules_free(struct rule *r) {
-    struct rule *rn;
-    while (r) {
-        rn = r->r_next;
-        free(r->r_regex);
-        if (r->r_pcre) pcre_free(r->r_pcre);
-        if (r->r_pcre_extra) pcre_free(r->r_pcre_extra);
-        if (r->r_filename) free(r->r_filename);
-        free(r);
-        r = rn;
+/* write_all FD DATA LEN
+ * Write LEN bytes of DATA to FD, reporting any failure. */
+static void write_all(const int fd, const char *data, const size_t len) {
+    ssize_t n;
+    if (-1 == (n = write(fd, data, len)))
+        our_error("write: %s", strerror(errno));
+    else if ((size_t)n < len)
+        our_error("write: wrote only %ld of %lu bytes", (long)n, (unsigned long)len);
+}
+
+/* ring_reap U
+ * Deal with any completed requests on U. */
+static void ring_reap(struct uring *u) {
+    unsigned head, tail;
+    head = *u->u_cq_head;
+    tail = __atomic_load_n(u->u_cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; ++head) {
+        struct io_uring_cqe *c = &u->u_cqes[head & *u->u_cq_mask];
+        int res = c->res;
+        --u->u_inflight;
+        if (c->user_data < URING_NBUFS) {
+            int i = (int)c->user_data;
+            --u->u_writing;
+            if (res == -ECANCELED)
+                res = 0;    /* an earlier write in its chain failed */
+            if (res < 0)
+                our_error("io_uring: write: %s", strerror(-res));
+            else if ((size_t)res < u->u_bufs[i].b_len) {
+                /* A short write cancels the rest of its chain. Completions
+                 * come in order, and the logfile isn't closed until they are
+                 * all in, so finishing each write here keeps them in order. */
+                write_all(u->u_bufs[i].b_fd, u->u_bufs[i].b_data + res, u->u_bufs[i].b_len - res);
+                if (u->u_datasync)
+                    fdatasync(u->u_bufs[i].b_fd);
+            }
+            u->u_bufs[i].b_state = buf_free;
+        } else if (c->user_data == ud_symlink && res >= 0)
+            u->u_link_made = 1;
+        else if (c->user_data == ud_rename) {
+            if (res < 0) {
+                if (res != -ECANCELED)
+                    our_error("%s: rename: %s", u->u_link_tmp, strerror(-res));
+                /* If making the symlink failed, TMP isn't ours to remove. */
+                if (u->u_link_made)
+                    unlink(u->u_link_tmp);
+            }
+            free(u->u_link_tmp);
+            u->u_link_tmp = NULL;
+        } else if (res < 0 && !(res == -ECANCELED && c->user_data == ud_fsync)) {
+            static const char *what[] = { "fdatasync", "close", "symlink" };
+            our_error("io_uring: %s: %s", what[c->user_data - ud_fsync], strerror(-res));
+        }
     }
+    __atomic_store_n(u->u_cq_head, head, __ATOMIC_RELEASE);
 }
 
-/* rules_test RULES LINE LEN
- * Test the LEN-byte log LINE against the RULES, returning the resulting
- * action. */
-enum action rules_test(struct rule *r, const char *line, const size_t len) {
-    struct rule *p;
-    for (p = r; p; p = p->r_next) {
-        int rc;
-        if (!p->r_pcre)
-            return p->r_action;
-        rc = pcre_exec(p->r_pcre, p->r_pcre_extra, line, (int)len, 0, 0, NULL, 0);
-        if (rc == 0)
-            return p->r_action;
-        else if (rc != PCRE_ERROR_NOMATCH)
-            our_error("pcre_exec(/%s/, ...) returned error value %d", p->r_regex, rc);
+static void ring_submit_writes(struct uring *u);
+static void ring_drain(struct uring *u);
+
+/* ring_enter U WAIT
+ * Submit any queued requests on U and, if WAIT is true, wait for at least one
+ * to complete; then reap completions, and submit any writes held back. */
+static void ring_enter(struct uring *u, const bool wait) {
+    while (u->u_to_submit || wait) {
+        int n;
+        n = (int)syscall(__NR_io_uring_enter, u->u_fd, u->u_to_submit, wait ? 1 : 0,
+                         wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            else if (errno == EBUSY || errno == EAGAIN) {
+                /* Completion queue is backed up; make room and retry. */
+                ring_reap(u);
+                continue;
+            }
+            our_error("io_uring_enter: %s", strerror(errno));
+            break;
+        }
+        u->u_to_submit -= n;
+        if (!u->u_to_submit)
+            break;
     }
-    return act_pass;
+    ring_reap(u);
+    ring_submit_writes(u);
 }
 
-/* parse_interval STRING
- * Interpret STRING, which matches /^\s*\d+\s*[mhdw]/, as an interval. Returns
- * the number of seconds in the interval on success, or 0 on failure. */
-time_t parse_interval(const char *s) {
-    const char *p;
-    time_t a;
-    p = s + strspn(s, " \t");
-    if (!isdigit(*p))
-        return 0;
-    a = (time_t)atoi(p);
-    p += strspn(p, "0123456789");
-    p += strspn(p, " \t");
-    if (*p) {
-        switch (tolower(*p)) {
-            case 'w':
-                a *= 7 * 24 * 3600;
-                break;
+/* ring_get_sqe U N
+ * Return the next of N submission queue entries on U, zeroed, submitting
+ * what is already queued if there isn't room. */
+static struct io_uring_sqe *ring_get_sqe(struct uring *u, const unsigned n) {
+    unsigned tail;
+    struct io_uring_sqe *s;
+    while (*u->u_sq_tail + n - __atomic_load_n(u->u_sq_head, __ATOMIC_ACQUIRE) > u->u_sq_entries)
+        ring_enter(u, u->u_inflight > 0);
+    tail = *u->u_sq_tail;
+    s = &u->u_sqes[tail & *u->u_sq_mask];
+    memset(s, 0, sizeof *s);
+    u->u_sq_array[tail & *u->u_sq_mask] = tail & *u->u_sq_mask;
+    __atomic_store_n(u->u_sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ++u->u_to_submit;
+    ++u->u_inflight;
+    return s;
+}
 
-            case 'd':
-                a *= 24 * 3600;
-                break;
+/* ring_submit_writes U
+ * If no writes are in flight on U, submit those of all queued buffers, in
+ * order, as a single chain. */
+static void ring_submit_writes(struct uring *u) {
+    struct io_uring_sqe *s = NULL;
+    unsigned n;
+    int i;
+
+    if (u->u_writing || u->u_submitting)
+        return;
+    for (n = 0, i = u->u_next; u->u_bufs[i].b_state == buf_queued; i = (i + 1) % URING_NBUFS)
+        ++n;
+    if (!n)
+        return;
+
+    /* Making room for the chain may mean entering the ring, which mustn't
+     * start another one. */
+    u->u_submitting = 1;
+    for (n *= u->u_datasync ? 2 : 1; u->u_bufs[u->u_next].b_state == buf_queued; u->u_next = i) {
+        i = u->u_next;
+        s = ring_get_sqe(u, n--);
+        s->opcode = IORING_OP_WRITE;
+        s->flags = IOSQE_IO_LINK;
+        s->fd = u->u_bufs[i].b_fd;
+        s->addr = (unsigned long)u->u_bufs[i].b_data;
+        s->len = u->u_bufs[i].b_len;
+        s->off = (__u64)-1;     /* at the file offset, i.e. the end */
+        s->user_data = i;
+        u->u_bufs[i].b_state = buf_writing;
+        ++u->u_writing;
+
+        if (u->u_datasync) {
+            s = ring_get_sqe(u, n--);
+            s->opcode = IORING_OP_FSYNC;
+            s->flags = IOSQE_IO_LINK;
+            s->fd = u->u_bufs[i].b_fd;
+            s->fsync_flags = IORING_FSYNC_DATASYNC;
+            s->user_data = ud_fsync;
+        }
+        i = (i + 1) % URING_NBUFS;
+    }
+    s->flags = 0;
+    u->u_submitting = 0;
+}
 
-            case 'h':
-                a *= 3600;
-                break;
+/* ring_queue_buffer U
+ * Queue a write of the current buffer of U, if it has anything in it, and
+ * move on to the next buffer, waiting for it to become free. */
+static void ring_queue_buffer(struct uring *u) {
+    int i = u->u_cur;
 
-            case 'm':
-                a *= 60;
-                break;
+    if (!u->u_bufs[i].b_len)
+        return;
 
-            case 's':
-                break;
-    
-            default:
-                a = 0;
-                break;
-        }
-    } else 
-        a *= 1; /* assume seconds */
-    
-    return a;
-}
+    u->u_bufs[i].b_state = buf_queued;
+    ring_submit_writes(u);
 
-static int logfile_mode = 0640;
-static uid_t logfile_uid = -1;
-static gid_t logfile_gid = -1;
+    u->u_cur = (i + 1) % URING_NBUFS;
+    while (u->u_bufs[u->u_cur].b_state != buf_free)
+        ring_enter(u, 1);
+    u->u_bufs[u->u_cur].b_len = 0;
+    u->u_bufs[u->u_cur].b_fd = -1;
+}
 
-/* reopen_logfile FD INTERVAL NAME FORMAT TIME SYMLINK
- * If the logfile open on FD should now be reopened under a new name because
- * INTERVAL has passed, do so, using FORMAT as an argument to strftime to
- * obtain a suffix added to NAME. If SYMLINK is true, create a symlink from
- * NAME itself to the new file. Returns a file descriptor open on the new
- * logfile, FD if no new logfile is needed, or -1 on error. */
-static int openflags = O_WRONLY | O_CREAT | O_APPEND;
-int reopen_logfile(int fd, const time_t interval, const char *name, const char *format, time_t *t, const int make_symlink) {
-    time_t now;
-    struct tm T;
-    static char *buf, *buf2;
-    static size_t buflen;
-    int newfd;
-#define MAXTIMELEN 256
-    if (!buf) {
-        buf = malloc(buflen = strlen(name) + MAXTIMELEN + 1);
-        buf2 = malloc(strlen(name) + 64);
+/* ring_write U FD DATA LEN
+ * Arrange for LEN bytes of DATA to be written to FD. */
+static void ring_write(struct uring *u, int fd, const char *data, const size_t len) {
+    int i = u->u_cur;
+    if (u->u_bufs[i].b_fd != fd || u->u_bufs[i].b_len + len > URING_BUFSIZE) {
+        ring_queue_buffer(u);
+        i = u->u_cur;
     }
+    if (len > URING_BUFSIZE) {
+        /* Too big to buffer; write it straight away, after what is queued. */
+        ring_drain(u);
+        write_all(fd, data, len);
+        if (u->u_datasync)
+            fdatasync(fd);
+        return;
+    }
+    u->u_bufs[i].b_fd = fd;
+    memcpy(u->u_bufs[i].b_data + u->u_bufs[i].b_len, data, len);
+    u->u_bufs[i].b_len += len;
+}
 
-    time(&now);
-    now -= now % interval;
-    /* Is the current logfile still valid? */
-    if (now == *t && fd != -1)
-        return fd;
+/* ring_flush U
+ * Submit writes of everything buffered on U, without waiting. */
+static void ring_flush(struct uring *u) {
+    ring_queue_buffer(u);
+    ring_enter(u, 0);
+}
 
-    localtime_r(&now, &T);
-    strcpy(buf, name);
-    strftime(buf + strlen(name), MAXTIMELEN, format, &T);
+/* ring_drain U
+ * Submit everything on U and wait for it all to complete. */
+static void ring_drain(struct uring *u) {
+    ring_flush(u);
+    while (u->u_inflight)
+        ring_enter(u, 1);
+}
 
-    if (-1 == (newfd = open(buf, openflags, logfile_mode))) {
-        our_error("%s: open: %s", buf, strerror(errno));
-        return fd;
+/* ring_input_read COOKIE BUF LEN
+ * Read function for the stream from which log lines are read when using
+ * io_uring, which is called once stdio has used up what it had buffered;
+ * before we might block reading more, submit what we have. */
+static ssize_t ring_input_read(void *cookie, char *buf, size_t len) {
+    struct pollfd pfd = { 0, POLLIN };
+    ssize_t n;
+    if (0 == poll(&pfd, 1, 0))
+        ring_flush(ring);
+    while (-1 == (n = read(0, buf, len)) && errno == EINTR);
+    return n;
+}
+
+/* ring_close U FD
+ * Close FD once everything previously queued on U has completed. */
+static void ring_close(struct uring *u, int fd) {
+    struct io_uring_sqe *s;
+    /* Writes may still be held back, so wait for them to go in. */
+    ring_queue_buffer(u);
+    while (u->u_writing || u->u_bufs[u->u_next].b_state == buf_queued)
+        ring_enter(u, 1);
+    s = ring_get_sqe(u, 1);
+    s->opcode = IORING_OP_CLOSE;
+    s->flags = IOSQE_IO_DRAIN;
+    s->fd = fd;
+    s->user_data = ud_close;
+    ring_enter(u, 0);
+}
+
+/* ring_symlink U TARGET TMP NAME
+ * Create a symlink TMP pointing to TARGET and rename it over NAME, using a
+ * pair of linked requests on U. Returns false if this can't be done. */
+static bool ring_symlink(struct uring *u, const char *target, const char *tmp, const char *name) {
+    struct io_uring_sqe *s;
+    static char *t;
+
+    if (!u->u_can_link || u->u_link_tmp)
+        return 0;
+    /* Both strings must stay valid until the requests complete. */
+    free(t);
+    t = strdup(target);
+    u->u_link_tmp = strdup(tmp);
+    u->u_link_made = 0;
+
+    s = ring_get_sqe(u, 2);
+    s->opcode = IORING_OP_SYMLINKAT;
+    s->flags = IOSQE_IO_LINK;
+    s->fd = AT_FDCWD;
+    s->addr = (unsigned long)t;
+    s->addr2 = (unsigned long)u->u_link_tmp;
+    s->user_data = ud_symlink;
+
+    s = ring_get_sqe(u, 1);
+    s->opcode = IORING_OP_RENAMEAT;
+    s->fd = AT_FDCWD;
+    s->addr = (unsigned long)u->u_link_tmp;
+    s->len = AT_FDCWD;
+    s->addr2 = (unsigned long)name;
+    s->user_data = ud_rename;
+
+    ring_enter(u, 0);
+    return 1;
+}
+
+/* ring_symlink_hook TARGET TMP NAME
+ * logfile_symlink_hook which makes the symlink through the ring. */
+static bool ring_symlink_hook(const char *target, const char *tmp, const char *name) {
+    return ring_symlink(ring, target, tmp, name);
+}
+#endif /* USE_IO_URING */
+
+/*
+ * Memory-mapped output. Each logfile is preallocated with fallocate(2) and
+ * lines are copied into a window of it mapped into memory, which is moved
+ * along as it fills. The number of bytes of real data in the file (the
+ * "high-water mark") is kept as an 8-byte native-endian integer in a sidecar
+ * file named after the logfile with ".hwm" appended, which is updated after
+ * the data are copied in. Readers should not read the logfile beyond that
+ * point, since the rest is preallocated zeroes. When the logfile is rotated,
+ * or at end of input, it is truncated to its real length and the sidecar is
+ * removed. If rotatelogs dies before then, the sidecar is left; at startup,
+ * any such sidecars for NAME are used to truncate their logfiles, and
+ * removed. A sidecar in use is write-locked, so that it isn't taken for one
+ * of these.
+ */
+
+/* MMAP_WINDOW
+ * Size of the part of the logfile which is mapped at once; a multiple of the
+ * page size. */
+#define MMAP_WINDOW (4 * 1024 * 1024)
+
+/* MMAP_ESTIMATE
+ * Default number of bytes to preallocate for a new logfile when we don't know
+ * the size of the previous one. */
+#define MMAP_ESTIMATE (16 * 1024 * 1024)
+
+static bool use_mmap, mmap_sync;
+static off_t mmap_estimate = MMAP_ESTIMATE;
+
+/* struct mapped
+ * State of the current memory-mapped logfile. */
+static struct {
+    int m_fd;               /* logfile, or -1 */
+    char *m_name, *m_hwm_name;
+    int m_hwm_fd;
+    uint64_t *m_hwm;        /* mapped sidecar */
+    off_t m_len, m_alloc;   /* bytes written and preallocated */
+    char *m_win;            /* mapped window of logfile, or NULL */
+    off_t m_winoff;
+    off_t m_last;           /* final length of the previous logfile */
+} mapped = { -1, NULL, NULL, -1 };
+
+/* mapped_preallocate LEN
+ * Try to make at least LEN bytes of the current logfile available, growing it
+ * by at least half if it must grow at all. Returns true on success. */
+static bool mapped_preallocate(off_t len) {
+    int e;
+    if (len <= mapped.m_alloc)
+        return 1;
+    if (len < mapped.m_alloc + mapped.m_alloc / 2)
+        len = mapped.m_alloc + mapped.m_alloc / 2;
+    len = (len + MMAP_WINDOW - 1) / MMAP_WINDOW * MMAP_WINDOW;
+    if ((e = posix_fallocate(mapped.m_fd, mapped.m_alloc, len - mapped.m_alloc))) {
+        our_error("%s: fallocate: %s; no longer using mmap", mapped.m_name, strerror(e));
+        return 0;
     }
-    
-    /* Set the ownership of the new file. Note that there's a race here, but
-     * it's not very important. */
-    if ((-1 != logfile_uid || -1 != logfile_gid)
-        && -1 == fchown(newfd, logfile_uid, logfile_gid))
-        /* This is not a fatal error; report it, but do not abort. */
-        our_error("%s: fchown(%d, %d): %s", buf, logfile_uid, logfile_gid, strerror(errno));
-
-    *t = now;
-
-    if (make_symlink) {
-        /* We must construct a relative symlink, because we are not evil. */
-        char *basename;
-        basename = strrchr(buf, '/');
-        if (basename) basename++;
-        else basename = buf;
-
-        /* symlink(2) cannot be used to overwrite an existing file, so we must
-         * create a symlink under a new name and rename it over the old one. */
-again:
-        sprintf(buf2, "%s.%d.%d.%d", name, (int)getpid(), (int)time(NULL), rand());
-        if (-1 == symlink(basename, buf2)) {
-            if (errno == EEXIST)
-                goto again;
-            else
-                our_error("%s: symlink to %s: %s", buf2, basename, strerror(errno));
+    mapped.m_alloc = len;
+    return 1;
+}
+
+/* mapped_release
+ * Unmap the current logfile, truncate it to its real length and remove its
+ * sidecar, leaving its file offset at the end so that it may be written in the
+ * ordinary way. */
+static void mapped_release(void) {
+    if (mapped.m_fd == -1)
+        return;
+    if (mapped.m_win)
+        munmap(mapped.m_win, MMAP_WINDOW);
+    if (-1 == ftruncate(mapped.m_fd, mapped.m_len))
+        our_error("%s: ftruncate: %s", mapped.m_name, strerror(errno));
+    lseek(mapped.m_fd, mapped.m_len, SEEK_SET);
+    munmap(mapped.m_hwm, sizeof *mapped.m_hwm);
+    close(mapped.m_hwm_fd);
+    unlink(mapped.m_hwm_name);
+    free(mapped.m_hwm_name);
+    free(mapped.m_name);
+    mapped.m_last = mapped.m_len;
+    mapped.m_fd = -1;
+    mapped.m_win = NULL;
+    mapped.m_hwm = NULL;
+}
+
+/* mapped_open FD FILENAME
+ * Start writing the logfile FILENAME, open read/write on FD, through a memory
+ * mapping. If this isn't possible, FD is left positioned at the end of the
+ * file for ordinary writes. */
+static void mapped_open(int fd, const char *filename) {
+    struct stat st;
+    uint64_t hwm = 0;
+    bool recovered = 0;
+
+    lseek(fd, 0, SEEK_END);
+
+    mapped.m_hwm_name = malloc(strlen(filename) + sizeof ".hwm");
+    sprintf(mapped.m_hwm_name, "%s.hwm", filename);
+    while (1) {
+        struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+        struct stat st2;
+        if (-1 == (mapped.m_hwm_fd = open(mapped.m_hwm_name, O_RDWR | O_CREAT, logfile_mode))) {
+            our_error("%s: open: %s", mapped.m_hwm_name, strerror(errno));
+            free(mapped.m_hwm_name);
+            return;
         }
-        
-        /* We should also set the ownership of the symlink. */
-        if ((-1 != logfile_uid || -1 != logfile_gid)
-            && -1 == lchown(buf2, logfile_uid, logfile_gid))
-            /* Again, not a fatal error. */
-            our_error("%s: lchown(%d, %d): %s", buf2, logfile_uid, logfile_gid, strerror(errno));
-        
-        if (-1 == rename(buf2, name)) {
-            our_error("%s: rename to %s: %s", buf2, name, strerror(errno));
-            unlink(buf2);
+        if (-1 == fcntl(mapped.m_hwm_fd, F_SETLK, &fl)) {
+            /* Someone else is writing this logfile through a mapping. */
+            our_error("%s: %s; not using mmap", mapped.m_hwm_name,
+                      errno == EAGAIN || errno == EACCES ? "in use" : strerror(errno));
+            close(mapped.m_hwm_fd);
+            free(mapped.m_hwm_name);
+            return;
         }
+        /* It may have been removed as left over before we locked it. */
+        if (-1 != fstat(mapped.m_hwm_fd, &st) && -1 != stat(mapped.m_hwm_name, &st2)
+            && st.st_dev == st2.st_dev && st.st_ino == st2.st_ino)
+            break;
+        close(mapped.m_hwm_fd);
+    }
+    if (-1 == fstat(fd, &st)) {
+        close(mapped.m_hwm_fd);
+        free(mapped.m_hwm_name);
+        return;
+    }
+    if ((-1 != logfile_uid || -1 != logfile_gid)
+        && -1 == fchown(mapped.m_hwm_fd, logfile_uid, logfile_gid))
+        our_error("%s: fchown(%d, %d): %s", mapped.m_hwm_name, logfile_uid, logfile_gid, strerror(errno));
+
+    /* A sidecar left by an earlier process tells us where its data ended. */
+    if (sizeof hwm == pread(mapped.m_hwm_fd, &hwm, sizeof hwm, 0) && hwm <= st.st_size)
+        recovered = 1;
+    else if (-1 == ftruncate(mapped.m_hwm_fd, sizeof hwm)) {
+        our_error("%s: ftruncate: %s", mapped.m_hwm_name, strerror(errno));
+        goto fail;
+    }
+    if (MAP_FAILED == (mapped.m_hwm = mmap(NULL, sizeof hwm, PROT_READ | PROT_WRITE, MAP_SHARED, mapped.m_hwm_fd, 0))) {
+        our_error("%s: mmap: %s", mapped.m_hwm_name, strerror(errno));
+        goto fail;
     }
 
-    return newfd;
+    mapped.m_fd = fd;
+    mapped.m_name = strdup(filename);
+    mapped.m_len = recovered ? (off_t)hwm : st.st_size;
+    mapped.m_alloc = st.st_size;
+    __atomic_store_n(mapped.m_hwm, (uint64_t)mapped.m_len, __ATOMIC_RELEASE);
+    mapped.m_win = NULL;
+
+    /* Preallocate as much as the previous logfile used, or our estimate. */
+    if (!mapped_preallocate(mapped.m_len + (mapped.m_last ? mapped.m_last : mmap_estimate)))
+        mapped_release();
+    return;
+
+fail:
+    close(mapped.m_hwm_fd);
+    unlink(mapped.m_hwm_name);
+    free(mapped.m_hwm_name);
 }
 
-/* reread_rules RULES FILENAME
- * If RULES is NULL, or if any of the files from which the rules were read have
- * changed, then read FILENAME and return the new set of rules; otherwise,
- * return RULES. */
-struct rule *reread_rules(struct rule *rules, const char *filename) {
-    struct rule *r;
-    bool doread = 0;
+/* mapped_recover NAME FORMAT
+ * Look in the directory of NAME for sidecars left by earlier processes which
+ * died while writing logfiles through a mapping, truncate each logfile to its
+ * high-water mark and remove the sidecar. */
+static void mapped_recover(const char *name, const char *format) {
+    const char *base;
+    char *dir, *path;
+    size_t dirlen, baselen;
+    DIR *d;
+    struct dirent *de;
+
+    base = strrchr(name, '/');
+    base = base ? base + 1 : name;
+    baselen = strlen(base);
+    dirlen = base - name;
+    dir = dirlen ? strndup(name, dirlen) : strdup(".");
+
+    if (!(d = opendir(dir))) {
+        our_error("%s: opendir: %s", dir, strerror(errno));
+        free(dir);
+        return;
+    }
 
-    if (!rules)
-        doread = 1;
-    else {
-        for (r = rules; r; r = r->r_next) {
-            struct stat st;
-            if (!r->r_filename)
-                continue;
-            if (-1 == stat(r->r_filename, &st)
-                || st.st_size != r->r_st.st_size
-                || st.st_mtime != r->r_st.st_mtime
-                || st.st_ino != r->r_st.st_ino) {
-                doread = 1;
+    path = malloc(dirlen + 256 + 1);
+    while ((de = readdir(d))) {
+        struct flock fl = { .l_type = F_WRLCK, .l_whence = SEEK_SET };
+        struct stat st;
+        struct tm T = {0};
+        const char *end;
+        size_t len = strlen(de->d_name);
+        uint64_t hwm;
+        int hfd, fd;
+
+        if (strncmp(de->d_name, base, baselen) || len <= baselen + 4
+            || strcmp(de->d_name + len - 4, ".hwm"))
+            continue;
+        memcpy(path, name, dirlen);
+        strcpy(path + dirlen, de->d_name);
+        path[dirlen + len - 4] = 0;
+        /* Only for logfiles which FORMAT could have named. */
+        if (!(end = strptime(path + dirlen + baselen, format, &T)) || *end)
+            continue;
+        path[dirlen + len - 4] = '.';
+
+        /* One still locked is in use by a live process. */
+        if (-1 == (hfd = open(path, O_RDWR | O_NOFOLLOW)))
+            continue;
+        if (-1 == fcntl(hfd, F_SETLK, &fl) || -1 == fstat(hfd, &st) || !S_ISREG(st.st_mode)) {
+            close(hfd);
+            continue;
+        }
+        path[dirlen + len - 4] = 0;
+        /* A sidecar too short to hold a mark was left before any space was
+         * preallocated, so there is nothing to truncate. */
+        if (sizeof hwm == pread(hfd, &hwm, sizeof hwm, 0)) {
+            if (-1 == (fd = open(path, O_WRONLY | O_NOFOLLOW)))
+                our_error("%s: open: %s", path, strerror(errno));
+            else {
+                if (-1 != fstat(fd, &st) && S_ISREG(st.st_mode) && hwm <= (uint64_t)st.st_size
+                    && -1 == ftruncate(fd, (off_t)hwm))
+                    our_error("%s: ftruncate: %s", path, strerror(errno));
+                close(fd);
+            }
+        }
+        path[dirlen + len - 4] = '.';
+        if (-1 == unlink(path))
+            our_error("%s: unlink: %s", path, strerror(errno));
+        close(hfd);
+    }
+    closedir(d);
+    free(path);
+    free(dir);
+}
+
+/* mapped_write DATA LEN
+ * Write LEN bytes of DATA to the current memory-mapped logfile. Returns false
+ * if there isn't one, in which case the caller should write(2) the data. */
+static bool mapped_write(const char *data, size_t len) {
+    size_t n;
+
+    if (mapped.m_fd == -1)
+        return 0;
+
+    while (len > 0) {
+        if (!mapped.m_win || mapped.m_len >= mapped.m_winoff + MMAP_WINDOW) {
+            /* Move the window on, allocating more space if we need it. */
+            if (mapped.m_win) {
+                if (mmap_sync)
+                    msync(mapped.m_win, MMAP_WINDOW, MS_SYNC);
+                munmap(mapped.m_win, MMAP_WINDOW);
+            }
+            mapped.m_win = NULL;
+            mapped.m_winoff = mapped.m_len - mapped.m_len % MMAP_WINDOW;
+            if (!mapped_preallocate(mapped.m_winoff + MMAP_WINDOW))
+                break;
+            if (MAP_FAILED == (mapped.m_win = mmap(NULL, MMAP_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, mapped.m_fd, mapped.m_winoff))) {
+                our_error("%s: mmap: %s; no longer using mmap", mapped.m_name, strerror(errno));
+                mapped.m_win = NULL;
                 break;
             }
         }
+        n = mapped.m_winoff + MMAP_WINDOW - mapped.m_len;
+        if (n > len) n = len;
+        memcpy(mapped.m_win + (mapped.m_len - mapped.m_winoff), data, n);
+        mapped.m_len += n;
+        data += n;
+        len -= n;
     }
 
-    if (doread && (r = rules_read(filename))) {
-        rules_free(rules);
-        rules = r;
+    /* Only now that the data are in place may readers see them. */
+    __atomic_store_n(mapped.m_hwm, (uint64_t)mapped.m_len, __ATOMIC_RELEASE);
+
+    if (len > 0) {
+        /* Couldn't map any more; carry on with ordinary writes. */
+        mapped_release();
+        write(logfile_fd, data, len);
+    } else if (mmap_sync) {
+        msync(mapped.m_win, mapped.m_len - mapped.m_winoff, MS_SYNC);
+        msync(mapped.m_hwm, sizeof *mapped.m_hwm, MS_SYNC);
     }
 
-    return rules;
+    return 1;
+}
+
+/* rotate_logfile FD INTERVAL NAME FORMAT TIME SYMLINK
+ * As reopen_logfile, but also do what rotatelogs must when a new logfile is
+ * opened: note it for retention, map it if -M was given, and close FD once
+ * any writes to it are done. */
+static int rotate_logfile(int fd, const time_t interval, const char *name, const char *format, time_t *t, const int make_symlink) {
+    int newfd;
+    if ((newfd = reopen_logfile(fd, interval, name, format, t, make_symlink)) == fd)
+        return fd;
+
+    retention_add(logfile_name);
+
+#ifdef USE_IO_URING
+    /* Writes to the old logfile may still be in flight, so it must be closed
+     * after them. */
+    if (ring && fd != -1) {
+        ring_close(ring, fd);
+        fd = -1;
+    }
+#endif
+
+    if (use_mmap) {
+        mapped_release();
+        mapped_open(newfd, logfile_name);
+    }
+
+    /* Don't hold the old logfile open, or its space can't be reclaimed once
+     * it has been deleted. */
+    if (fd != -1)
+        close(fd);
+
+    return newfd;
 }
 
 #ifndef SENDMAIL_BIN
@@ -488,21 +1191,87 @@ struct rule *reread_rules(struct rule *rules, const char *filename) {
  * Default minimum interval between sending two emails, in seconds. */
 #define EMAIL_INTERVAL 1800
 
+/* escape_class
+ * For each byte value, 0 if it may be copied through unchanged, otherwise the
+ * character to put after a backslash when escaping it ('x' meaning a hex
+ * escape). Filled in by escape_init. */
+static unsigned char escape_class[256];
+
+/* escape_fill
+ * Fill in escape_class; called once, by escape_init. */
+static void escape_fill(void) {
+    int c;
+    for (c = 0; c < 256; ++c)
+        escape_class[c] = (c >= 0x20 && c < 0x7f) ? 0 : 'x';
+    escape_class['\n'] = 0;
+    escape_class['\t'] = 't';
+    escape_class['\r'] = 'r';
+}
+
+/* escape_init
+ * Fill in escape_class, if that hasn't been done already. The digest thread
+ * escapes lines too, so this must be safe to call from any thread. */
+static void escape_init(void) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, escape_fill);
+}
+
+/* Word-at-a-time test for whether any byte in a word is below 0x20 or is
+ * 0x7f or above; such words must be examined byte by byte. */
+#define ONES    ((unsigned long)-1 / 0xff)
+#define HIGHS   (ONES * 0x80)
+#define word_needs_escape(w) \
+    ((((w) - ONES * 0x20) | ((w) + ONES * 0x01) | (w)) & HIGHS)
+
+/* escape_bytes OUT IN LEN
+ * Write an escaped copy of the LEN bytes at IN to OUT, which must have room
+ * for 4 * LEN bytes. Newlines and printable ASCII characters are copied
+ * unchanged; tab and carriage return become "\t" and "\r"; everything else
+ * becomes a "\xHH" escape. Returns the number of bytes written to OUT. */
+size_t escape_bytes(char *out, const char *in, const size_t len) {
+    static const char hex[] = "0123456789abcdef";
+    const unsigned char *p = (const unsigned char *)in, *end = p + len, *run;
+    char *q = out;
+
+    escape_init();
+    while (p < end) {
+        /* Find the end of the run of bytes which need no escaping, a word at
+         * a time where possible, and copy it in one go. */
+        run = p;
+        while (p + sizeof(unsigned long) <= end) {
+            unsigned long w;
+            memcpy(&w, p, sizeof w);
+            if (word_needs_escape(w))
+                break;
+            p += sizeof w;
+        }
+        while (p < end && !escape_class[*p])
+            ++p;
+        memcpy(q, run, p - run);
+        q += p - run;
+
+        if (p < end) {
+            *q++ = '\\';
+            if ((*q++ = escape_class[*p]) == 'x') {
+                *q++ = hex[*p >> 4];
+                *q++ = hex[*p & 0xf];
+            }
+            ++p;
+        }
+    }
+
+    return q - out;
+}
+
 /* escaped_write_lines STREAM LINES LEN
  * Write the LEN-byte log LINES to STREAM, escaping non-ASCII characters */
 void escaped_write_lines(FILE *fp, const char *line, const size_t len) {
-    const char *p;
-    for (p = line; p < line + len; ++p) {
-        switch (*p) {
-            case '\n': fprintf(fp, "\n"); break;
-            case '\t': fprintf(fp, "\\t"); break;
-            case '\r': fprintf(fp, "\\r"); break;
-            default:
-                   if (isprint(*p)) fputc(*p, fp);
-                   else fprintf(fp, "\\x%02x", (unsigned int)*p);
-                   break;
-        }
-    }
+    static char *buf;
+    static size_t buflen;
+    static unsigned idle;
+    sized_buffer(&buf, &buflen, 4 * len);
+    fwrite(buf, 1, escape_bytes(buf, line, len), fp);
+    trim_buffer(&buf, &buflen, 4 * len, &idle);
 }
 
 /* do_email NAME ADDRESS LINE LEN FD
@@ -587,6 +1356,612 @@ int do_email(const char *name, const char *addr, const char *line, const size_t
     _exit(0);
 }
 
+/* send_email ADDRESS TEXT LEN
+ * Send the LEN-byte message TEXT, which should begin with its headers, to
+ * ADDRESS, and wait for sendmail to finish. Nothing but system calls is used
+ * in the child process, so this may be called from any thread. Returns 0 on
+ * success, or -1 on failure. */
+int send_email(const char *addr, const char *text, size_t len) {
+    pid_t p;
+    int pp[2], st;
+    char *s_argv[] = { SENDMAIL_BIN, (char*)addr, NULL },
+         *s_envp[] = { "PATH=/bin", NULL };
+
+    if (-1 == pipe(pp)) {
+        our_error("pipe: %s", strerror(errno));
+        return -1;
+    }
+    if (-1 == (p = fork())) {
+        our_error("fork: %s", strerror(errno));
+        close(pp[0]);
+        close(pp[1]);
+        return -1;
+    } else if (p == 0) {
+        /* Exec sendmail. */
+        int fd;
+        close(pp[1]);
+        dup2(pp[0], 0);
+        fd = open("/dev/null", O_WRONLY);
+        dup2(fd, 1);
+        dup2(fd, 2);
+        execve(s_argv[0], s_argv, s_envp);
+        _exit(1);
+    }
+
+    close(pp[0]);
+    while (len > 0) {
+        ssize_t n;
+        if (-1 == (n = write(pp[1], text, len))) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        text += n;
+        len -= n;
+    }
+    close(pp[1]);
+
+    if (-1 == waitpid(p, &st, 0) || !WIFEXITED(st) || WEXITSTATUS(st)) {
+        our_error("%s: failed to send email to %s", SENDMAIL_BIN, addr);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Alert digests. With -D, rather than emailing the first alerting line and a
+ * few seconds of context, we count alerting lines over each -i interval,
+ * grouped by their text with runs of digits treated as equal, and send one
+ * email at the end of the interval summarising them. Memory use is fixed.
+ */
+
+/* DIGEST_SLOTS, DIGEST_GROUPS
+ * Size of the hash table of groups, and the most groups we track; lines in
+ * any further groups are only counted. */
+#define DIGEST_SLOTS        256
+#define DIGEST_GROUPS       192
+
+/* DIGEST_EXEMPLARS, DIGEST_EXEMPLAR_LEN
+ * Number of example lines kept for each group (the first few and the most
+ * recent), and the maximum length of each. */
+#define DIGEST_EXEMPLARS    3
+#define DIGEST_EXEMPLAR_LEN 400
+
+/* struct digest_group
+ * Alerting lines seen during the current interval with a given hash. */
+struct digest_group {
+    uint64_t d_hash;
+    unsigned long d_count;      /* 0 if slot is unused */
+    time_t d_first, d_last;
+    size_t d_len[DIGEST_EXEMPLARS];
+    char d_exemplar[DIGEST_EXEMPLARS][DIGEST_EXEMPLAR_LEN];
+};
+
+static struct {
+    struct digest_group g[DIGEST_SLOTS];
+    int ngroups;
+    unsigned long nlines, nother;
+    time_t start;
+    bool done;
+    const char *name, *addr;
+    time_t interval;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} digest = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/* digest_hash LINE LEN
+ * Return a hash of the LEN-byte LINE, treating each run of digits as a single
+ * character and ignoring any trailing newline. */
+static uint64_t digest_hash(const char *line, size_t len) {
+    const unsigned char *p = (const unsigned char *)line, *end = p + len;
+    uint64_t h = 14695981039346656037ULL;   /* FNV-1a */
+    bool indigits = 0;
+    if (len > 0 && line[len - 1] == '\n')
+        --end;
+    for (; p < end; ++p) {
+        if (isdigit(*p)) {
+            if (indigits)
+                continue;
+            indigits = 1;
+            h = (h ^ '#') * 1099511628211ULL;
+        } else {
+            indigits = 0;
+            h = (h ^ *p) * 1099511628211ULL;
+        }
+    }
+    return h;
+}
+
+/* digest_add LINE LEN
+ * Record the LEN-byte alerting LINE in the current digest. */
+static void digest_add(const char *line, size_t len) {
+    uint64_t h;
+    struct digest_group *g = NULL;
+    unsigned i, k;
+    time_t now;
+
+    h = digest_hash(line, len);
+    time(&now);
+    if (len > 0 && line[len - 1] == '\n')
+        --len;
+    if (len > DIGEST_EXEMPLAR_LEN)
+        len = DIGEST_EXEMPLAR_LEN;
+
+    pthread_mutex_lock(&digest.mutex);
+    ++digest.nlines;
+    for (i = h % DIGEST_SLOTS, k = 0; k < DIGEST_SLOTS; i = (i + 1) % DIGEST_SLOTS, ++k) {
+        if (digest.g[i].d_count && digest.g[i].d_hash == h) {
+            g = digest.g + i;
+            break;
+        } else if (!digest.g[i].d_count) {
+            if (digest.ngroups < DIGEST_GROUPS) {
+                g = digest.g + i;
+                g->d_hash = h;
+                g->d_first = now;
+                ++digest.ngroups;
+            }
+            break;
+        }
+    }
+
+    if (!g)
+        ++digest.nother;
+    else {
+        /* Keep the first few lines, then keep replacing the last. */
+        k = g->d_count < DIGEST_EXEMPLARS ? g->d_count : DIGEST_EXEMPLARS - 1;
+        memcpy(g->d_exemplar[k], line, len);
+        g->d_len[k] = len;
+        ++g->d_count;
+        g->d_last = now;
+    }
+    pthread_mutex_unlock(&digest.mutex);
+}
+
+static int digest_compare(const void *a, const void *b) {
+    const struct digest_group *A = *(const struct digest_group **)a,
+                              *B = *(const struct digest_group **)b;
+    return A->d_count > B->d_count ? -1 : A->d_count < B->d_count;
+}
+
+/* digest_format STREAM
+ * Write an email summarising the current digest to STREAM, and empty it. Call
+ * with digest.mutex held. */
+static void digest_format(FILE *fp) {
+    struct digest_group *sorted[DIGEST_GROUPS];
+    char hostname[64] = {0}, when[64];
+    int i, n, k;
+    struct tm T;
+
+    gethostname(hostname, (sizeof hostname) - 1);
+    fprintf(fp,
+            "Subject: %lu error%s logged to %s on %s\n"
+            "To: %s\n"
+            "\n",
+            digest.nlines, digest.nlines == 1 ? "" : "s",
+            digest.name, hostname, digest.addr);
+
+    localtime_r(&digest.start, &T);
+    strftime(when, sizeof when, "%Y-%m-%d %H:%M:%S", &T);
+    fprintf(fp, "%lu alerting line%s in %d group%s since %s.\n\n",
+            digest.nlines, digest.nlines == 1 ? "" : "s",
+            digest.ngroups, digest.ngroups == 1 ? "" : "s", when);
+
+    for (i = n = 0; i < DIGEST_SLOTS; ++i)
+        if (digest.g[i].d_count)
+            sorted[n++] = digest.g + i;
+    qsort(sorted, n, sizeof *sorted, digest_compare);
+
+    for (i = 0; i < n; ++i) {
+        struct digest_group *g = sorted[i];
+        localtime_r(&g->d_first, &T);
+        strftime(when, sizeof when, "%H:%M:%S", &T);
+        fprintf(fp, "%lu time%s, first at %s", g->d_count, g->d_count == 1 ? "" : "s", when);
+        localtime_r(&g->d_last, &T);
+        strftime(when, sizeof when, "%H:%M:%S", &T);
+        fprintf(fp, ", last at %s:\n", when);
+        for (k = 0; k < DIGEST_EXEMPLARS && k < g->d_count; ++k) {
+            if (k == DIGEST_EXEMPLARS - 1 && g->d_count > DIGEST_EXEMPLARS)
+                fprintf(fp, "    ...\n");
+            fprintf(fp, "    ");
+            escaped_write_lines(fp, g->d_exemplar[k], g->d_len[k]);
+            fputc('\n', fp);
+        }
+        fputc('\n', fp);
+    }
+    if (digest.nother)
+        fprintf(fp, "%lu further line%s in groups not tracked.\n",
+                digest.nother, digest.nother == 1 ? "" : "s");
+
+    memset(digest.g, 0, sizeof digest.g);
+    digest.ngroups = 0;
+    digest.nlines = digest.nother = 0;
+}
+
+/* digest_thread ARG
+ * At the end of each interval, send an email summarising any alerting lines
+ * seen during it. */
+static void *digest_thread(void *arg) {
+    bool done;
+    pthread_mutex_lock(&digest.mutex);
+    do {
+        struct timespec ts = { digest.start + digest.interval, 0 };
+        char *text = NULL;
+        size_t len = 0;
+        FILE *fp;
+
+        while (!digest.done && time(NULL) < ts.tv_sec)
+            pthread_cond_timedwait(&digest.cond, &digest.mutex, &ts);
+        done = digest.done;
+
+        if (digest.nlines && (fp = open_memstream(&text, &len))) {
+            digest_format(fp);
+            fclose(fp);
+        }
+        time(&digest.start);
+
+        /* Don't hold up logging while we start sendmail. */
+        pthread_mutex_unlock(&digest.mutex);
+        if (text) {
+            send_email(digest.addr, text, len);
+            free(text);
+        }
+        pthread_mutex_lock(&digest.mutex);
+    } while (!done);
+    pthread_mutex_unlock(&digest.mutex);
+
+    return NULL;
+}
+
+/* digest_start NAME ADDRESS INTERVAL
+ * Start collecting alerting lines logged to NAME, to be sent to ADDRESS every
+ * INTERVAL seconds. Returns false on failure. */
+static bool digest_start(const char *name, const char *addr, time_t interval) {
+    int e;
+    digest.name = name;
+    digest.addr = addr;
+    digest.interval = interval;
+    time(&digest.start);
+    if ((e = pthread_create(&digest.thread, NULL, digest_thread, NULL))) {
+        our_error("pthread_create: %s", strerror(e));
+        return 0;
+    }
+    return 1;
+}
+
+/* digest_finish
+ * Send any outstanding digest and stop the digest thread. */
+static void digest_finish(void) {
+    pthread_mutex_lock(&digest.mutex);
+    digest.done = 1;
+    pthread_cond_signal(&digest.cond);
+    pthread_mutex_unlock(&digest.mutex);
+    pthread_join(digest.thread, NULL);
+}
+
+/*
+ * Forwarding of logged lines to a collector over a socket. Lines are framed
+ * (newline-terminated, or preceded by a 4-byte big-endian length) and
+ * appended to a buffer; a thread swaps that buffer for a second one and sends
+ * its contents, reconnecting with backoff if the collector goes away. Only
+ * that thread does any network I/O, so a collector outage can't hold up
+ * writing the logfile; if the buffer fills while the collector is away,
+ * further lines are dropped, and the number dropped is reported.
+ */
+
+/* FORWARD_BUFSIZE
+ * Size of each of the two forwarding buffers. */
+#define FORWARD_BUFSIZE     (1024 * 1024)
+
+/* FORWARD_BATCH, FORWARD_DELAY
+ * Send once this many bytes are buffered, or after this many milliseconds. */
+#define FORWARD_BATCH       16384
+#define FORWARD_DELAY       200
+
+/* FORWARD_DGRAM_MAX
+ * Largest datagram we send; lines are packed into datagrams up to this size
+ * (a single longer line is sent in a datagram of its own). */
+#define FORWARD_DGRAM_MAX   32768
+
+/* FORWARD_BACKOFF_MAX, FORWARD_LINGER
+ * Longest wait between reconnection attempts, and how long we keep trying to
+ * send what's buffered at end of input, in seconds. */
+#define FORWARD_BACKOFF_MAX 30
+#define FORWARD_LINGER      5
+
+static struct {
+    const char *dest;
+    int type;                   /* SOCK_STREAM or SOCK_DGRAM */
+    struct sockaddr_un sun;     /* if sun_family is AF_UNIX */
+    char *host, *port;          /* otherwise */
+    bool length_prefix;
+    char *buf[2];
+    size_t len[2];
+    int fill;                   /* buffer the main thread appends to */
+    unsigned long dropped;
+    bool done, warned;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} fwd = { .mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+/* forward_record_len DATA LEN
+ * Return the length of the framed record at the start of the LEN bytes at
+ * DATA. */
+static size_t forward_record_len(const char *data, const size_t len) {
+    if (fwd.length_prefix) {
+        uint32_t n;
+        memcpy(&n, data, sizeof n);
+        return sizeof n + ntohl(n);
+    } else {
+        const char *nl = memchr(data, '\n', len);
+        return nl ? nl + 1 - data : len;
+    }
+}
+
+/* forward_connect
+ * Open a non-blocking socket connected to the collector, waiting up to a
+ * second for the connection. Returns the socket, or -1 on failure. Only the
+ * first of a run of failures is reported. */
+static int forward_connect(void) {
+    struct addrinfo hints = {0}, *ai = NULL, *a;
+    int fd = -1;
+
+    if (fwd.sun.sun_family == AF_UNIX) {
+        if (-1 == (fd = socket(AF_UNIX, fwd.type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0))
+            || -1 == connect(fd, (struct sockaddr *)&fwd.sun, sizeof fwd.sun)) {
+            if (!fwd.warned)
+                our_error("%s: connect: %s", fwd.dest, strerror(errno));
+            if (fd != -1) close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(fwd.host, fwd.port, &hints, &ai)) {
+        if (!fwd.warned)
+            our_error("%s: cannot resolve address", fwd.dest);
+        return -1;
+    }
+    for (a = ai; a; a = a->ai_next) {
+        struct pollfd pfd;
+        int e;
+        socklen_t l = sizeof e;
+        if (-1 == (fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, a->ai_protocol)))
+            continue;
+        if (0 == connect(fd, a->ai_addr, a->ai_addrlen))
+            break;
+        e = errno;
+        if (e == EINPROGRESS) {
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            if (1 == poll(&pfd, 1, 1000)
+                && 0 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &e, &l) && e == 0)
+                break;
+            if (e == EINPROGRESS)
+                e = ETIMEDOUT;
+        }
+        if (!fwd.warned)
+            our_error("%s: connect: %s", fwd.dest, strerror(e));
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(ai);
+    return fd;
+}
+
+/* forward_send FD DATA LEN
+ * Send some of the LEN bytes of framed records at DATA on FD, waiting up to a
+ * second for the socket to become writable. Datagrams hold whole records.
+ * Returns the number of bytes sent, or -1 on error. */
+static ssize_t forward_send(int fd, const char *data, const size_t len) {
+    ssize_t n;
+    size_t l;
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+
+    if (fwd.type == SOCK_STREAM)
+        l = len;
+    else {
+        /* Pack as many whole records as will fit. */
+        l = forward_record_len(data, len);
+        while (l < len) {
+            size_t r = forward_record_len(data + l, len - l);
+            if (l + r > FORWARD_DGRAM_MAX)
+                break;
+            l += r;
+        }
+    }
+
+    while (-1 == (n = send(fd, data, l, MSG_NOSIGNAL | MSG_DONTWAIT))) {
+        if (errno == EINTR)
+            continue;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (1 != poll(&pfd, 1, 1000))
+                return 0;
+        } else if (errno == EMSGSIZE) {
+            our_error("%s: dropping oversized datagram of %u bytes", fwd.dest, (unsigned)l);
+            return l;
+        } else {
+            our_error("%s: send: %s", fwd.dest, strerror(errno));
+            return -1;
+        }
+    }
+    return n;
+}
+
+/* forward_thread ARG
+ * Send buffered records to the collector, reconnecting as necessary. */
+static void *forward_thread(void *arg) {
+    int fd = -1, backoff = 1, p = 0;
+    size_t off = 0, plen = 0;
+    time_t retry = 0, linger = 0;
+
+    pthread_mutex_lock(&fwd.mutex);
+    while (1) {
+        struct timespec ts;
+
+        if (!plen) {
+            /* Wait for a batch, then take the buffer it's in. */
+            if (!fwd.done && fwd.len[fwd.fill] < FORWARD_BATCH) {
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_nsec += FORWARD_DELAY * 1000000L;
+                ts.tv_sec += ts.tv_nsec / 1000000000L;
+                ts.tv_nsec %= 1000000000L;
+                pthread_cond_timedwait(&fwd.cond, &fwd.mutex, &ts);
+            }
+            if (!fwd.len[fwd.fill]) {
+                if (fwd.done)
+                    break;
+                continue;
+            }
+            p = fwd.fill;
+            fwd.fill = !p;
+            plen = fwd.len[p];
+            off = 0;
+            if (fwd.dropped) {
+                our_error("%s: dropped %lu lines while collector unavailable", fwd.dest, fwd.dropped);
+                fwd.dropped = 0;
+            }
+        }
+        if (fwd.done && !linger)
+            linger = time(NULL) + FORWARD_LINGER;
+        pthread_mutex_unlock(&fwd.mutex);
+
+        if (fd == -1 && time(NULL) >= retry) {
+            if (-1 == (fd = forward_connect())) {
+                fwd.warned = 1;
+                retry = time(NULL) + backoff;
+                if ((backoff *= 2) > FORWARD_BACKOFF_MAX)
+                    backoff = FORWARD_BACKOFF_MAX;
+            } else {
+                fwd.warned = 0;
+                backoff = 1;
+            }
+        }
+
+        if (fd != -1) {
+            ssize_t n;
+            if (-1 == (n = forward_send(fd, fwd.buf[p] + off, plen - off))) {
+                /* Start again from the first record not wholly sent. */
+                size_t r = 0;
+                while (r + forward_record_len(fwd.buf[p] + r, plen - r) <= off)
+                    r += forward_record_len(fwd.buf[p] + r, plen - r);
+                off = r;
+                close(fd);
+                fd = -1;
+                retry = time(NULL) + backoff;
+            } else if ((off += n) == plen)
+                plen = 0;
+        }
+
+        pthread_mutex_lock(&fwd.mutex);
+        if (plen && linger && time(NULL) >= linger) {
+            our_error("%s: giving up on %u unsent bytes", fwd.dest, (unsigned)(plen - off));
+            break;
+        }
+        if (plen && fd == -1) {
+            /* Wait until we can retry, waking early if told to finish. */
+            ts.tv_sec = retry;
+            ts.tv_nsec = 0;
+            pthread_cond_timedwait(&fwd.cond, &fwd.mutex, &ts);
+        }
+        if (!plen)
+            fwd.len[p] = 0;
+    }
+    pthread_mutex_unlock(&fwd.mutex);
+
+    if (fd != -1)
+        close(fd);
+    return NULL;
+}
+
+/* forward_start DEST LENGTH_PREFIX
+ * Start forwarding logged lines to DEST, which is "unix:PATH",
+ * "unixgram:PATH" or "tcp:HOST:PORT", framed with a length prefix if
+ * LENGTH_PREFIX is true or a newline otherwise. Returns false if DEST is
+ * invalid or the thread can't be started. */
+static bool forward_start(const char *dest, const bool length_prefix) {
+    const char *path = NULL;
+    int e;
+
+    fwd.dest = dest;
+    fwd.length_prefix = length_prefix;
+    if (0 == strncmp(dest, "unix:", 5)) {
+        fwd.type = SOCK_STREAM;
+        path = dest + 5;
+    } else if (0 == strncmp(dest, "unixgram:", 9)) {
+        fwd.type = SOCK_DGRAM;
+        path = dest + 9;
+    } else if (0 == strncmp(dest, "tcp:", 4) && strrchr(dest + 4, ':')) {
+        fwd.type = SOCK_STREAM;
+        fwd.host = strndup(dest + 4, strrchr(dest, ':') - (dest + 4));
+        fwd.port = strdup(strrchr(dest, ':') + 1);
+        /* Allow "tcp:[::1]:PORT". */
+        if (*fwd.host == '[' && fwd.host[strlen(fwd.host) - 1] == ']') {
+            memmove(fwd.host, fwd.host + 1, strlen(fwd.host) - 2);
+            fwd.host[strlen(fwd.host) - 2] = 0;
+        }
+    } else {
+        fprintf(stderr, "rotatelogs: '%s' is not a valid address for -F\n", dest);
+        return 0;
+    }
+    if (path) {
+        if (!*path || strlen(path) >= sizeof fwd.sun.sun_path) {
+            fprintf(stderr, "rotatelogs: '%s' is not a valid socket path\n", path);
+            return 0;
+        }
+        fwd.sun.sun_family = AF_UNIX;
+        strcpy(fwd.sun.sun_path, path);
+    }
+
+    fwd.buf[0] = malloc(FORWARD_BUFSIZE);
+    fwd.buf[1] = malloc(FORWARD_BUFSIZE);
+    if ((e = pthread_create(&fwd.thread, NULL, forward_thread, NULL))) {
+        fprintf(stderr, "rotatelogs: pthread_create: %s\n", strerror(e));
+        return 0;
+    }
+    return 1;
+}
+
+/* forward_add LINE LEN
+ * Queue the LEN-byte LINE, which ends with a newline, to be forwarded. */
+static void forward_add(const char *line, size_t len) {
+    size_t n;
+    char *p;
+
+    if (fwd.length_prefix && len > 0 && line[len - 1] == '\n')
+        --len;
+    n = fwd.length_prefix ? len + sizeof(uint32_t) : len;
+
+    pthread_mutex_lock(&fwd.mutex);
+    if (fwd.len[fwd.fill] + n > FORWARD_BUFSIZE)
+        ++fwd.dropped;
+    else {
+        p = fwd.buf[fwd.fill] + fwd.len[fwd.fill];
+        if (fwd.length_prefix) {
+            uint32_t l = htonl((uint32_t)len);
+            memcpy(p, &l, sizeof l);
+            p += sizeof l;
+        }
+        memcpy(p, line, len);
+        if ((fwd.len[fwd.fill] += n) >= FORWARD_BATCH)
+            pthread_cond_signal(&fwd.cond);
+    }
+    pthread_mutex_unlock(&fwd.mutex);
+}
+
+/* forward_finish
+ * Send anything still buffered, giving up after FORWARD_LINGER seconds if the
+ * collector is unavailable, and stop the forwarding thread. */
+static void forward_finish(void) {
+    pthread_mutex_lock(&fwd.mutex);
+    fwd.done = 1;
+    pthread_cond_signal(&fwd.cond);
+    pthread_mutex_unlock(&fwd.mutex);
+    pthread_join(fwd.thread, NULL);
+}
+
 /* parse_owner OWNER
  * Set logfile_uid and logfile_gid from OWNER, which should be of the form
  * "USER", "USER:GROUP" or ":GROUP". Returns nonzero on success or prints an
@@ -630,10 +2005,104 @@ fail:
     return ret;
 }
 
+/* SPLICE_CHUNK
+ * Maximum number of bytes moved from standard input to the logfile by each
+ * splice(2) call in passthrough mode. */
+#define SPLICE_CHUNK (1024 * 1024)
+
+/* ends_with_newline FD
+ * Return true if the logfile open on FD, at its current offset, is empty or
+ * ends with a newline. FD must be open for reading. */
+static bool ends_with_newline(int fd) {
+    off_t pos;
+    char c;
+    if ((pos = lseek(fd, 0, SEEK_CUR)) <= 0)
+        return 1;
+    return pread(fd, &c, 1, pos - 1) != 1 || c == '\n';
+}
+
+/* splice_passthrough INTERVAL NAME FORMAT TIME SYMLINK
+ * Copy standard input, which must be a pipe, to the logfile without bringing
+ * it into user space, rotating the logfile as rotate_logfile would. Lines are
+ * read into a buffer only where a partial line must be completed before a
+ * rotation, or given a trailing newline at end of file. Returns 0 at end of
+ * file, or -1 if splice(2) failed, in which case the caller should carry on
+ * in the ordinary way. */
+static int splice_passthrough(const time_t interval, const char *name, const char *format, time_t *t, const int make_symlink) {
+    static char buf[65536];
+    ssize_t n;
+
+    if (logfile_fd == -1)
+        return -1;
+    lseek(logfile_fd, 0, SEEK_END);
+
+    while (1) {
+        struct pollfd pfd = { 0, POLLIN };
+        time_t now;
+        int fd;
+
+        /* Wait for input before looking at the time, so that data which
+         * arrive after a rotation is due go into the new logfile. */
+        if (-1 == poll(&pfd, 1, -1)) {
+            if (errno == EINTR)
+                continue;
+            our_error("poll: %s", strerror(errno));
+            return -1;
+        }
+
+        time(&now);
+        if (now - now % interval != *t && !ends_with_newline(logfile_fd)) {
+            /* Rotation is due, but the last line in the old logfile is
+             * unfinished. Read up to the end of it and write it there;
+             * anything after that belongs in the new logfile. */
+            char *nl = NULL;
+            while (!nl && (n = read(0, buf, sizeof buf)) != 0) {
+                if (n == -1) {
+                    if (errno == EINTR)
+                        continue;
+                    our_error("read: %s", strerror(errno));
+                    return -1;
+                }
+                if ((nl = memchr(buf, '\n', n)))
+                    write(logfile_fd, buf, nl + 1 - buf);
+                else
+                    write(logfile_fd, buf, n);
+            }
+            if (!nl) {
+                write(logfile_fd, "\n", 1);
+                return 0;
+            }
+            fd = logfile_fd;
+            logfile_fd = rotate_logfile(logfile_fd, interval, name, format, t, make_symlink);
+            if (logfile_fd != fd)
+                lseek(logfile_fd, 0, SEEK_END);
+            write(logfile_fd, nl + 1, buf + n - (nl + 1));
+            continue;
+        }
+
+        fd = logfile_fd;
+        logfile_fd = rotate_logfile(logfile_fd, interval, name, format, t, make_symlink);
+        if (logfile_fd != fd)
+            lseek(logfile_fd, 0, SEEK_END);
+
+        n = splice(0, NULL, logfile_fd, NULL, SPLICE_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            our_error("splice: %s", strerror(errno));
+            return -1;
+        } else if (n == 0) {
+            if (!ends_with_newline(logfile_fd))
+                write(logfile_fd, "\n", 1);
+            return 0;
+        }
+    }
+}
+
 /* main ARGC ARGV
  * Entry point. */
 int main(int argc, char *argv[]) {
-    const char *optstr = "+hlf:e:i:r:m:o:s";
+    const char *optstr = "+hlf:e:i:r:m:o:sxuSMp:DF:Ln:N:k:a:b:";
     extern char *optarg;
     extern int opterr, optopt, optind;
     int c;
@@ -644,12 +2113,25 @@ int main(int argc, char *argv[]) {
     char *email = NULL;
     char *rules = NULL;
     char *line;
+    FILE *in = stdin;       /* where log lines are read from */
     size_t linelen;
     struct rule *r = NULL;
     int email_fd = -1;      /* pipe to email-sending subprocess */
     int email_interval = EMAIL_INTERVAL;
     time_t last_email = 0;
-
+    int sanitize = 0;
+    int passthrough = 0, use_splice = 0;
+    int use_uring = 0;
+    int use_digest = 0;
+    char *forward = NULL;
+    int length_prefix = 0;
+    size_t max_line = 0;
+    enum { long_truncate, long_split, long_stream } long_policy = long_truncate;
+    bool more, streaming = 0;
+    enum action stream_action = act_pass;
+    struct stat st;
+
+    main_thread = pthread_self();
     signal(SIGPIPE, SIG_IGN);
     
     opterr = 0;
@@ -679,6 +2161,38 @@ int main(int argc, char *argv[]) {
                 }
                 break;
 
+            case 'D':
+                use_digest = 1;
+                break;
+
+            case 'F':
+                forward = optarg;
+                break;
+
+            case 'L':
+                length_prefix = 1;
+                break;
+
+            case 'n':
+                if (!(max_line = (size_t)parse_size(optarg))) {
+                    fprintf(stderr, "rotatelogs: '%s' is not a valid size\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'N':
+                if (0 == strcmp(optarg, "truncate"))
+                    long_policy = long_truncate;
+                else if (0 == strcmp(optarg, "split"))
+                    long_policy = long_split;
+                else if (0 == strcmp(optarg, "stream"))
+                    long_policy = long_stream;
+                else {
+                    fprintf(stderr, "rotatelogs: option -N should be 'truncate', 'split' or 'stream'\n");
+                    return 1;
+                }
+                break;
+
             case 'r':
                 rules = optarg;
                 break;
@@ -700,6 +2214,50 @@ int main(int argc, char *argv[]) {
                 openflags |= O_SYNC;
                 break;
 
+            case 'x':
+                sanitize = 1;
+                break;
+
+            case 'u':
+                use_uring = 1;
+                break;
+
+            case 'S':
+                use_splice = 1;
+                break;
+
+            case 'M':
+                use_mmap = 1;
+                break;
+
+            case 'p':
+                if (!(mmap_estimate = parse_size(optarg))) {
+                    fprintf(stderr, "rotatelogs: '%s' is not a valid size\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'k':
+                if ((retain_count = atoi(optarg)) < 1) {
+                    fprintf(stderr, "rotatelogs: option -k should give a positive number of files\n");
+                    return 1;
+                }
+                break;
+
+            case 'a':
+                if (!(retain_age = parse_interval(optarg))) {
+                    fprintf(stderr, "rotatelogs: '%s' is not a valid interval\n", optarg);
+                    return 1;
+                }
+                break;
+
+            case 'b':
+                if (!(retain_bytes = parse_size(optarg))) {
+                    fprintf(stderr, "rotatelogs: '%s' is not a valid size\n", optarg);
+                    return 1;
+                }
+                break;
+
             case '?':
             default:
                 if (strchr(optstr, optopt))
@@ -723,32 +2281,140 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    /* Before anything looks at their sizes. */
+    mapped_recover(name, format);
+    retention_start(name, format);
+
+    if (use_digest && !email) {
+        fprintf(stderr, "rotatelogs: option -D requires -e\n");
+        return 1;
+    }
+
+    if (forward && !forward_start(forward, length_prefix))
+        return 1;
+
+    if (use_mmap) {
+        if (use_uring) {
+            fprintf(stderr, "rotatelogs: options -M and -u cannot be used together\n");
+            return 1;
+        }
+        /* Mapping a file for writing needs it open read/write. */
+        openflags = (openflags & ~(O_WRONLY | O_APPEND)) | O_RDWR;
+        mmap_sync = (openflags & O_SYNC) != 0;
+        /* Nor can we write messages at the file offset, which doesn't move
+         * as lines are copied into the mapping. */
+        logfile_indirect = 1;
+    }
+
+    if (use_uring) {
+#ifdef USE_IO_URING
+        /* With io_uring, -s is done by an fdatasync after each write. */
+        if ((ring = ring_setup(openflags & O_SYNC))) {
+            static cookie_io_functions_t input_io = { ring_input_read };
+            openflags &= ~O_SYNC;
+            logfile_symlink_hook = ring_symlink_hook;
+            logfile_indirect = 1;
+            if ((in = fopencookie(NULL, "r", input_io)))
+                setvbuf(in, NULL, _IOFBF, URING_BUFSIZE);
+            else
+                in = stdin;
+        } else
+#endif
+            our_error("io_uring not available; using ordinary writes");
+    }
+
+    /* With nothing to filter, email or escape, we can move data straight from
+     * the pipe into the logfile. Since splice(2) won't write to an O_APPEND
+     * file, and we need to look back at the last byte written, logfiles are
+     * opened read/write and we seek to the end ourselves; that is only safe
+     * if we are the only writer, so it must be asked for. */
+    if (use_splice && !rules && !email && !sanitize && !use_uring && !use_mmap && !forward
+        && !max_line && -1 != fstat(0, &st) && S_ISFIFO(st.st_mode)) {
+        passthrough = 1;
+        openflags = (openflags & ~(O_WRONLY | O_APPEND)) | O_RDWR;
+    }
+
     time(&ft);
-    logfile_fd = reopen_logfile(logfile_fd, interval, name, format, &ft, make_symlink);
+    logfile_fd = rotate_logfile(logfile_fd, interval, name, format, &ft, make_symlink);
+    if (use_digest && !digest_start(name, email, email_interval))
+        use_digest = 0;
+    if (passthrough) {
+        if (0 == splice_passthrough(interval, name, format, &ft, make_symlink))
+            return 0;
+        /* Otherwise fall back to reading lines in the ordinary way. */
+        openflags = (openflags & ~O_RDWR) | O_WRONLY | O_APPEND;
+        if (logfile_fd != -1)
+            fcntl(logfile_fd, F_SETFL, fcntl(logfile_fd, F_GETFL) | O_APPEND);
+    }
     if (rules) r = reread_rules(r, rules);
-    while ((line = getlogline(stdin, &linelen))) {
+    while ((line = (char *)getlogline(in, &linelen, max_line, &more))) {
         enum action a;
-        if (rules) {
+        char *out;
+        size_t outlen, skipped = 0;
+        if (more && long_policy == long_truncate) {
+            /* Throw away the rest, and say how much we threw away below. */
+            skipped = skip_line(in);
+            more = 0;
+        }
+        if (rules || skipped) {
             /* Ugh. getlogline returns a static buffer. */
             static char *buf;
             static size_t buflen;
-            if (!buf || buflen < linelen + 1) buf = realloc(buf, buflen = (linelen + 1) * 2);
+            static unsigned idle;
+            sized_buffer(&buf, &buflen, linelen + 64);
+            trim_buffer(&buf, &buflen, linelen + 64, &idle);
             memcpy(buf, line, linelen + 1);
             line = buf;
-            r = reread_rules(r, rules);
+            if (skipped) {
+                if (line[linelen - 1] == '\n')
+                    --linelen;
+                linelen += sprintf(line + linelen, " [%lu bytes truncated]\n", (unsigned long)skipped);
+            }
+        }
+        if (streaming)
+            /* The rest of an overlong line goes wherever its start went. */
+            a = stream_action;
+        else {
+            if (rules)
+                r = reread_rules(r, rules);
+            a = rules_test(r, line, linelen);
         }
-        a = rules_test(r, line, linelen);
         if (a != act_drop) {
             /* XXX consider adding timestamp if one is not present? */
-            logfile_fd = reopen_logfile(logfile_fd, interval, name, format, &ft, make_symlink);
-            if (line[linelen - 1] != '\n')
+            if (!streaming)
+                logfile_fd = rotate_logfile(logfile_fd, interval, name, format, &ft, make_symlink);
+            if (line[linelen - 1] != '\n' && !(more && long_policy == long_stream))
                 line[linelen++] = '\n';
-            write(logfile_fd, line, linelen);
+            if (sanitize) {
+                static char *ebuf;
+                static size_t ebuflen;
+                static unsigned idle;
+                sized_buffer(&ebuf, &ebuflen, 4 * linelen);
+                trim_buffer(&ebuf, &ebuflen, 4 * linelen, &idle);
+                out = ebuf;
+                outlen = escape_bytes(ebuf, line, linelen);
+            } else {
+                out = line;
+                outlen = linelen;
+            }
+#ifdef USE_IO_URING
+            if (ring)
+                ring_write(ring, logfile_fd, out, outlen);
+            else
+#endif
+            if (!mapped_write(out, outlen))
+                write(logfile_fd, out, outlen);
                 /* Not much we can do if this fails (e.g. because we're out of
                  * disk space). "Never test for an error condition you don't
                  * know how to handle." */
-
-            if (a != act_passnoemail) {
+            if (forward)
+                forward_add(out, outlen);
+
+            if (streaming)
+                ;   /* only the start of an overlong line is emailed */
+            else if (a != act_passnoemail && use_digest)
+                digest_add(line, linelen);
+            else if (a != act_passnoemail && email) {
                 /* First try writing it to an existing mail subprocess. */
                 if (email_fd != -1) {
                     ssize_t n;
@@ -779,8 +2445,21 @@ int main(int argc, char *argv[]) {
                 }
             }
         }
+        streaming = more && long_policy == long_stream;
+        stream_action = a;
     }
 
+#ifdef USE_IO_URING
+    if (ring)
+        ring_drain(ring);
+#endif
+    mapped_release();
+
+    if (use_digest)
+        digest_finish();
+    if (forward)
+        forward_finish();
+
     rules_free(r); /* keep valgrind happy */
 
     return 0;
@@ -0,0 +1,193 @@
+#!/bin/sh
+#
+# test.sh:
+# Scripted checks of rotatelogs. Run by "make check", or by hand with RL set
+# to the binary to test. Some checks wait for interval boundaries, so the
+# whole run takes a little while.
+#
+# Copyright (c) 2005 UK Citizens Online Democracy. All rights reserved.
+# Email: chris@mysociety.org; WWW: http://www.mysociety.org/
+#
+
+RL=${RL:-./rotatelogs}
+case "$RL" in /*) ;; *) RL="$(pwd)/$RL" ;; esac
+# A build whose sendmail appends to the file named as the address, for checks
+# of emailed lines; those are skipped if there isn't one.
+RL_MAIL=${RL_MAIL:-./rotatelogs-check}
+case "$RL_MAIL" in /*) ;; *) RL_MAIL="$(pwd)/$RL_MAIL" ;; esac
+T=$(mktemp -d) || exit 1
+trap 'rm -rf "$T"' EXIT
+cd "$T" || exit 1
+failed=0
+
+# check DESCRIPTION COMMAND ...
+# Run COMMAND and report whether it succeeded.
+check () {
+    desc="$1"
+    shift
+    if "$@" ; then
+        echo "ok - $desc"
+    else
+        echo "FAIL - $desc"
+        failed=1
+    fi
+}
+
+# align INTERVAL
+# Wait until just after the start of an INTERVAL-second rotation period, and
+# print the time it started.
+align () {
+    while [ $(( $(date +%s) % $1 )) -ne 0 ] ; do sleep 0.1 ; done
+    now=$(date +%s)
+    echo $(( now - now % $1 ))
+}
+
+# contains FILE TEXT
+# Succeed if FILE consists of the single line TEXT.
+contains () {
+    [ "$(cat "$1" 2>/dev/null)" = "$2" ]
+}
+
+# bytes N
+# Print a line of N - 1 'x's.
+bytes () {
+    head -c $(( $1 - 1 )) /dev/zero | tr '\0' x
+    echo
+}
+
+# collect SOCKET FILE
+# In the background, listen on the unix-domain stream SOCKET and copy what is
+# sent over one connection to FILE; return once it is listening.
+collect () {
+    perl -MIO::Socket::UNIX -e '
+        $l = IO::Socket::UNIX->new(Local => $ARGV[0], Listen => 1) or die "$ARGV[0]: $!\n";
+        open(F, ">", $ARGV[1]) or die "$ARGV[1]: $!\n";
+        $c = $l->accept();
+        print F while (<$c>);' "$1" "$2" &
+    while [ ! -S "$1" ] ; do sleep 0.1 ; done
+}
+
+# Retention by size must count the logfile found at startup at its size when
+# it was rotated out, not when rotatelogs started.
+t=$(align 4)
+bytes 1000 > ret.$(( t - 8 ))
+touch -d @$(( t - 8 )) ret.$(( t - 8 ))
+echo start > ret.$t
+( bytes 1000 ; sleep 4.5 ; echo next ; sleep 1 ) | "$RL" -b 1500 "$T/ret" 4
+check "retention counts a reused logfile at its final size" test ! -e ret.$(( t - 8 ))
+
+# -D must group alerting lines which differ only in their digits, and send
+# one digest at end of input, with the first two and the latest lines of each
+# group as examples.
+if [ -x "$RL_MAIL" ] ; then
+    printf 'timeout after %s ms\n' 5 1234 77 9 > dig.in
+    printf 'disk %s full\n' 3 4 >> dig.in
+    "$RL_MAIL" -D -e "$T/dig.mail" -f .log "$T/dig" 86400 < dig.in
+    cat > dig.want <<'EOF'
+6 alerting lines in 2 groups since
+4 times, first at
+    timeout after 5 ms
+    timeout after 1234 ms
+    ...
+    timeout after 9 ms
+2 times, first at
+    disk 3 full
+    disk 4 full
+EOF
+    grep -e '^ ' -e 'alerting' -e 'times' dig.mail | sed -e 's/since.*/since/' -e 's/first at.*/first at/' > dig.got
+    check "-D groups lines differing only in digits" cmp -s dig.got dig.want
+else
+    echo "skip - -D grouping (no $RL_MAIL)"
+fi
+
+# -F must deliver every line to the collector as it was logged, and with
+# -L as length-prefixed records without their newlines.
+{ echo one ; echo ; bytes 100000 ; seq 1 10000 ; } > fwd.in
+collect "$T/fwd.sock" fwd.got
+"$RL" -F "unix:$T/fwd.sock" -f .log "$T/fwd" 86400 < fwd.in
+wait
+check "-F delivers lines to the collector" cmp -s fwd.got fwd.in
+collect "$T/fwdl.sock" fwdl.got
+"$RL" -F "unix:$T/fwdl.sock" -L -f .log "$T/fwdl" 86400 < fwd.in
+wait
+perl -0777 -ne 'while (length) { $n = unpack("N", $_); print substr($_, 4, $n), "\n"; substr($_, 0, 4 + $n) = ""; }' fwdl.got > fwdl.out
+check "-F -L delivers length-prefixed records" cmp -s fwdl.out fwd.in
+
+# -x escapes control characters and non-ASCII bytes, both within runs
+# long enough to be scanned a word at a time and at their ends.
+printf 'plain printable text, longer than a word\n\tbell\007 esc\033[1m caf\303\251\r\nends with \177\n' \
+    | "$RL" -x -f .log "$T/esc" 86400
+cat > esc.want <<'EOF'
+plain printable text, longer than a word
+\tbell\x07 esc\x1b[1m caf\xc3\xa9\r
+ends with \x7f
+EOF
+check "-x escapes control and high bytes" cmp -s esc.log esc.want
+
+# Without -S, two processes writing the same logfile from pipes mustn't
+# overwrite each other's lines.
+( echo one ; sleep 1 ; echo three ) | "$RL" -f .log "$T/two" 86400 &
+( sleep 0.5 ; echo two ) | "$RL" -f .log "$T/two" 86400
+wait
+check "two writers to one logfile both get their lines in" contains two.log "$(printf 'one\ntwo\nthree')"
+
+# -u must write the same logfile as ordinary writes, appending to what is
+# there already, even with lines too long to buffer and with another writer.
+{ seq 1 100000 ; bytes 100000 ; seq 1 1000 ; } > uring.in
+for f in plain uring ; do echo first > $f.log ; done
+"$RL" -f .log "$T/plain" 86400 < uring.in
+"$RL" -u -f .log "$T/uring" 86400 < uring.in 2>/dev/null
+check "-u output matches ordinary writes" cmp -s plain.log uring.log
+( echo one ; sleep 1 ; echo three ) | "$RL" -u -f .log "$T/two-u" 86400 2>/dev/null &
+( sleep 0.5 ; echo two ) | "$RL" -f .log "$T/two-u" 86400
+wait
+check "-u shares a logfile with another writer" contains two-u.log "$(printf 'one\ntwo\nthree')"
+
+# Passthrough (splice) mode must put lines arriving after an interval
+# boundary into the new logfile, even though it was waiting in splice(2) when
+# the boundary passed.
+t=$(align 2)
+( echo before ; sleep 2.5 ; echo after ) | "$RL" -S "$T/spl" 2
+check "passthrough keeps lines before the boundary" contains spl.$t before
+check "passthrough rotates at the boundary" contains spl.$(( t + 2 )) after
+
+# With -M, messages from rotatelogs itself (here, failing to reach the -F
+# collector) must not be written over the mapped log lines.
+( echo one ; sleep 1 ; echo two ) | "$RL" -M -f .log -F "unix:$T/nosock" "$T/map" 86400 2>/dev/null
+check "mmap output isn't overwritten by error messages" contains map.log "$(printf 'one\ntwo')"
+
+# A .hwm sidecar left by a killed -M process must be used at startup to
+# truncate the preallocated zeroes from its logfile, even without -M.
+( echo one ; sleep 3 ) | "$RL" -M -f .log "$T/dead" 86400 &
+sleep 1
+kill -9 $!
+wait $! 2>/dev/null
+echo two | "$RL" -f .log "$T/dead" 86400
+printf 'one\ntwo\n' > dead.want
+check "a left-over .hwm file truncates its logfile" cmp -s dead.log dead.want
+check "a left-over .hwm file is removed" test ! -e dead.log.hwm
+
+# -n limits lines to LENGTH bytes, not counting the newline, and -N says
+# what becomes of the rest.
+bytes 1024 > lim.in
+"$RL" -n 1023 -f .log "$T/lim" 86400 < lim.in
+check "-n passes a line of exactly LENGTH bytes" cmp -s lim.log lim.in
+printf '0123456789\n0123456789A\n' | "$RL" -n 10 -f .log "$T/trunc" 86400
+check "-N truncate cuts longer lines and says how much" \
+    contains trunc.log "$(printf '0123456789\n0123456789 [1 bytes truncated]')"
+printf '0123456789abcdefghijKLMNO\n' | "$RL" -n 10 -N split -f .log "$T/split" 86400
+check "-N split makes a line of each LENGTH bytes" \
+    contains split.log "$(printf '0123456789\nabcdefghij\nKLMNO')"
+echo 'drop ^skip' > lim.rules
+printf 'skip this whole line\nkeep this whole line\n' \
+    | "$RL" -n 10 -N stream -r "$T/lim.rules" -f .log "$T/stream" 86400
+check "-N stream filters whole lines by their start" contains stream.log 'keep this whole line'
+
+# Rules before an include must still be applied; the included file's
+# placeholder rule sits between them and the line in the list of rules.
+printf 'drop foo\ninclude %s\n' "$T/inc.rules" > main.rules
+echo 'drop bar' > inc.rules
+printf 'foo\nbar\nbaz\n' | "$RL" -r "$T/main.rules" -f .log "$T/inc" 86400
+check "rules before an include are applied" contains inc.log baz
+
+exit $failed
@@ -11,83 +11,1406 @@
 
 static const char rcsid[] = "$Id: run-with-lockfile.c,v 1.2 2013-03-04 09:33:23 ian Exp $";
 
+#define _GNU_SOURCE     /* for accept4, struct ucred */
+
 #include <sys/types.h>
 #include <sys/wait.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#ifdef USE_CAPTURE
+#   include "logwriter.h"
+#   define CAPTURE_OPTS     "L:I:P:"
+#   define CAPTURE_SYNOPSIS "[-L NAME [-I INTERVAL] [-P RULES]] "
+#   define CAPTURE_USAGE \
+"With -L, capture the standard output and error of COMMAND and write them\n" \
+"to logfiles as rotatelogs would: each file is named NAME followed by '.' and\n" \
+"the number of seconds since the epoch, and a new one is started every\n" \
+"INTERVAL (by default, one day), given as for rotatelogs. With -P, lines are\n" \
+"filtered by the file of RULES, as given to rotatelogs -r; the compiled rules\n" \
+"are kept in NAME.rulecache, and used by later runs until RULES changes.\n" \
+"Output written after COMMAND exits, by something it left running, is lost.\n" \
+"In batch mode, all jobs write to the same logfiles, a whole line at a time,\n" \
+"so the lines of jobs run in parallel are interleaved.\n" \
+"\n"
+#else
+#   define CAPTURE_OPTS     ""
+#   define CAPTURE_SYNOPSIS ""
+#   define CAPTURE_USAGE    ""
+#endif
 
 #define SHELL_PATH "/bin/sh"
 #define SHELL_NAME "sh"
 #define WAIT_AFTER_TERM 10  /* seconds to wait after SIGTERM sent */
 
-const char *opts="hnet:";
+const char *opts="hnet:s:d:q:c:rR:b:j:fw:" CAPTURE_OPTS;
 pid_t pid;
 int timeout = 0;
 char *command;
 
+/* Set by SIGALRM when the time allowed by -w for taking the lock is up. */
+static volatile sig_atomic_t wait_expired;
+
+static void wait_alarm(int sig) {
+    wait_expired = 1;
+}
+
+/* WAIT_REPEAT
+ * Interval, in microseconds, at which SIGALRM is repeated once the time
+ * allowed by -w is up. */
+#define WAIT_REPEAT 100000
+
+/* wait_timer SECONDS
+ * Arrange for wait_expired to be set after SECONDS, or, if SECONDS is 0, stop
+ * doing so. The signal is then repeated until the timer is stopped, so that a
+ * blocking call started just after it was first delivered is interrupted in
+ * its turn and can see that the time is up. */
+static void wait_timer(int seconds) {
+    struct itimerval it = { { 0, 0 }, { seconds, 0 } };
+    if (seconds) {
+        struct sigaction sa = { 0 };
+        sa.sa_handler = wait_alarm;     /* no SA_RESTART, so fcntl returns */
+        sigaction(SIGALRM, &sa, NULL);
+        it.it_interval.tv_usec = WAIT_REPEAT;
+    }
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
 void usage(FILE *fp) {
     fprintf(fp,
-"run-with-lockfile [-ne] [-t timeout] FILE COMMAND\n"
+"run-with-lockfile [-nerf] [-c N] [-t timeout] [-w SECONDS] [-s SOCKET]\n"
+"        [-R REPORT] " CAPTURE_SYNOPSIS "FILE COMMAND\n"
+"run-with-lockfile [-n] [-t timeout] [-w SECONDS] [-s SOCKET] [-R REPORT]\n"
+"        " CAPTURE_SYNOPSIS "[-j N] -b JOBFILE\n"
+"run-with-lockfile -d SOCKET | -q SOCKET\n"
 "\n"
 "Open (perhaps create) and fcntl-lock FILE, then run COMMAND. If option -n\n"
 "is given, fail immediately if the lock is held by another process;\n"
-"otherwise, wait for the lock. When COMMAND is run, the variable LOCKFILE\n"
-"will be set to FILE in its environment. If -e is given, execute the command\n"
-"directly; otherwise COMMAND is run by passing it to /bin/sh with the -c\n"
-"parameter.  The full path of the command should be given when -e is used.\n"
+"otherwise, wait for the lock, for at most SECONDS if -w is given. When\n"
+"COMMAND is run, the variable LOCKFILE will be set to FILE in its environment,\n"
+"and LOCKWAIT to the number of seconds spent waiting for the lock. If -e is\n"
+"given, execute the command directly; otherwise COMMAND is run by passing it\n"
+"to /bin/sh with the -c parameter.  The full path of the command should be\n"
+"given when -e is used.\n"
 "\n"
-"Exit value is that returned from COMMAND; or, if -n is given and the lock\n"
-"could not be obtained, 100; or, if another error occurs, 101.\n"
+"By default the lock is exclusive. With -r, take a shared lock instead, so\n"
+"that any number of commands run with -r may hold it at once, but not while\n"
+"a command holds it exclusively. With -c, allow up to N commands run with -c\n"
+"to hold the lock at once; such commands may also run alongside those run\n"
+"with -r, but not alongside an exclusive holder. Each is given one of N\n"
+"slots, whose number (from 1) is set in the variable LOCKSLOT. All commands\n"
+"using the same FILE should give the same N.\n"
 "\n"
-"If a timeout value is given with -t, the command will be killed if it runs\n"
-"for longer than that number of seconds, and the exit value will be 102.\n"
-"Note that, for the timeout to be effective, -e should also be used.\n"
+"Waiters for an exclusive lock are woken in no particular order, so one may\n"
+"wait indefinitely behind a stream of others. With -f, take the exclusive\n"
+"lock fairly: each waiter draws a ticket, and waiters are served in ticket\n"
+"order. Fairness holds only among commands run with -f; those not using -f\n"
+"wait until none is queued. The ticket counter is kept in FILE.ticket, which\n"
+"is created if need be and must be writable by all users of the lock.\n"
+"\n"
+"Exit value is that returned from COMMAND (or 128 plus the signal number if\n"
+"it was killed by a signal); or, if -n is given and the lock could not be\n"
+"obtained, 100; or, if -w is given and the lock could not be obtained within\n"
+"SECONDS, 103; or, if another error occurs, 101.\n"
+"\n"
+"COMMAND is run in a process group of its own. If a timeout value is given\n"
+"with -t, and the command runs for longer than that number of seconds, TERM\n"
+"is sent to its process group, then KILL %d seconds later if it is still\n"
+"running, and the exit value will be 102. TERM, INT and HUP signals sent to\n"
+"run-with-lockfile are passed on to the process group. But if standard input\n"
+"is a terminal, COMMAND stays in the process group of run-with-lockfile, so\n"
+"that it may still use the terminal; it then gets signals from the terminal\n"
+"directly, and only COMMAND itself is sent TERM and KILL on timeout.\n"
+"\n"
+"With -R, when COMMAND exits, or the lock could not be obtained, append a\n"
+"line to the file REPORT (or standard error if REPORT is '-') of the form\n"
+"\n"
+"    exit=N timedout=0|1 wait=S wall=S user=S sys=S maxrss=KB lock=FILE\n"
+"\n"
+"giving the exit value, whether COMMAND timed out, the time spent waiting\n"
+"for the lock, the elapsed, user and system time of COMMAND and its\n"
+"waited-for descendants in seconds, and their largest maximum resident set\n"
+"size.\n"
+"\n"
+CAPTURE_USAGE
+"With -b, read a list of jobs from JOBFILE (or standard input if JOBFILE is\n"
+"'-'), one per line, each of the form\n"
+"\n"
+"    LOCK TIMEOUT COMMAND\n"
+"\n"
+"and run them, up to N at once (by default, the number of processors). Each\n"
+"job is run as if by 'run-with-lockfile -t TIMEOUT LOCK COMMAND', with the\n"
+"other options shown above applying to each job; -w counts from the job's\n"
+"first try for its lock, not from the start of the batch. A TIMEOUT of '-'\n"
+"means that given with -t, and 0 means none. Jobs locking the same file run\n"
+"one at a time, in the order listed; others may run in parallel. Blank lines\n"
+"and lines starting with '#' are ignored. When all the jobs have finished,\n"
+"print a table of their exit values (marked '*' if they timed out) and\n"
+"timings. The exit value is 0 if every job succeeded, otherwise that of the\n"
+"first job listed which failed, or 101 if a signal stopped a job from being\n"
+"run.\n"
+"\n"
+"With -d, run a lock server listening on the unix socket SOCKET, which holds\n"
+"named locks on behalf of its clients; it runs in the foreground. With -s,\n"
+"rather than locking FILE, ask the lock server at SOCKET for the lock named\n"
+"FILE. The lock is released when run-with-lockfile exits, however that\n"
+"happens. With -q, print a line for each lock held or waited for on the lock\n"
+"server at SOCKET, giving 'holding' or 'waiting', the lock name, the pid of\n"
+"the client and the number of seconds it has held or waited for the lock.\n"
 "\n"
 "Copyright (c) 2003-4 Chris Lightfoot, Mythic Beasts Ltd.\n"
 "%s\n",
-        rcsid
+        WAIT_AFTER_TERM, rcsid
         );
 }
 
-void alarm_handler_kill(int sig) {
-    fprintf(stderr, "run-with-lockfile: timed out; sending KILL to pid %d\n", pid);
-    kill(pid, SIGKILL);
-    exit(102);
+/* timespec_diff A B
+ * Return A - B in seconds. */
+static double timespec_diff(const struct timespec *a, const struct timespec *b) {
+    return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+/* watch_signals OLDSIGS
+ * Block SIGCHLD and the signals we pass on to commands, saving the old mask
+ * in *OLDSIGS, and return a signalfd from which they may be read, or -1 on
+ * error. */
+static int watch_signals(sigset_t *oldsigs) {
+    sigset_t sigs;
+    int sfd;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGCHLD);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGHUP);
+    sigprocmask(SIG_BLOCK, &sigs, oldsigs);
+    if (-1 == (sfd = signalfd(-1, &sigs, SFD_CLOEXEC)))
+        fprintf(stderr, "run-with-lockfile: signalfd: %s\n", strerror(errno));
+    return sfd;
+}
+
+/* own_group
+ * Whether commands are started in process groups of their own, so that a
+ * timeout can kill everything they start. They aren't when standard input is
+ * a terminal: a new group wouldn't be the terminal's foreground group, so
+ * the command would be stopped if it used the terminal. */
+static bool own_group;
+
+/* signal_command PID SIG
+ * Send SIG to the command PID, and to its process group if it has one. */
+static void signal_command(pid_t pid, int sig) {
+    kill(own_group ? -pid : pid, sig);
+}
+
+/* pass_signal PID SI
+ * Pass on to the command PID the signal described by SI, which we have been
+ * sent, unless the terminal will have sent it to the command already. */
+static void pass_signal(pid_t pid, const struct signalfd_siginfo *si) {
+    if (si->ssi_signo == SIGCHLD || (!own_group && si->ssi_code == SI_KERNEL))
+        return;
+    signal_command(pid, si->ssi_signo);
+}
+
+/* spawn COMMAND ARGV LOCK WAIT OUT OLDSIGS
+ * Start COMMAND, in a process group of its own if own_group is set, with
+ * LOCKFILE set to LOCK, LOCKWAIT to the WAIT
+ * seconds spent waiting for it, and the signal mask set to OLDSIGS. If OUT is
+ * not -1, it becomes the command's standard output and error. If ARGV is
+ * NULL, COMMAND is passed to the shell; otherwise it is executed directly with
+ * arguments ARGV. Returns the pid, or -1 on error. */
+static pid_t spawn(const char *command, char *const *argv, const char *lock, double wait, int out, const sigset_t *oldsigs) {
+    pid_t p;
+    if ((p = fork()) == 0) {
+        char buf[32];
+        if (own_group)
+            setpgid(0, 0);
+        if (out != -1) {
+            dup2(out, 1);
+            dup2(out, 2);
+        }
+        sigprocmask(SIG_SETMASK, oldsigs, NULL);
+        setenv("LOCKFILE", lock, 1);
+        snprintf(buf, sizeof buf, "%.3f", wait);
+        setenv("LOCKWAIT", buf, 1);
+        if (argv)
+            execv(command, argv);
+        else
+            execl(SHELL_PATH, SHELL_NAME, "-c", command, NULL);
+        fprintf(stderr, "run-with-lockfile: %s: %s\n", argv ? command : SHELL_PATH, strerror(errno));
+        _exit(101);
+    } else if (p < 0)
+        fprintf(stderr, "run-with-lockfile: fork failed: %s\n", strerror(errno));
+    else if (own_group)
+        setpgid(p, p);  /* in case we get to kill(-p, ...) first */
+    return p;
+}
+
+/* timeout_step PID COMMAND TIMEOUT STAGE DEADLINE
+ * Called when the child PID, running COMMAND, passes its DEADLINE. At *STAGE
+ * 0, send TERM to it (or its process group) and move DEADLINE on by
+ * WAIT_AFTER_TERM; at stage 1, send KILL. Advances *STAGE. */
+static void timeout_step(pid_t pid, const char *command, int timeout, int *stage, struct timespec *deadline) {
+    const char *what = own_group ? "process group" : "pid";
+    if ((*stage)++ == 0) {
+        fprintf(stderr, "run-with-lockfile: %s timed out after %ds; sending TERM to %s %d and waiting for it to die...\n", command, timeout, what, pid);
+        signal_command(pid, SIGTERM);
+        deadline->tv_sec += WAIT_AFTER_TERM;
+    } else {
+        fprintf(stderr, "run-with-lockfile: timed out; sending KILL to %s %d\n", what, pid);
+        signal_command(pid, SIGKILL);
+    }
+}
+
+/* exit_value STATUS TIMEDOUT
+ * Return our exit value for a command which exited with wait STATUS. */
+static int exit_value(int status, bool timed_out) {
+    if (timed_out)
+        return 102;
+    else if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    else
+        return 128 + WTERMSIG(status);
+}
+
+struct capture {
+    int c_fd;           /* read end of the command's output pipe, or -1 */
+    char *c_buf;        /* partial line read so far */
+    size_t c_len, c_size;
+};
+
+#ifdef USE_CAPTURE
+/*
+ * Output capture. With -L, the standard output and error of each command go
+ * through a pipe to us, and each line, unless the rules given with -P say to
+ * drop it, is written to a logfile named after NAME and rotated every
+ * INTERVAL, just as rotatelogs would do if the command's output were piped to
+ * it. The rules are compiled once and kept in NAME.rulecache, so that later
+ * runs needn't compile them again unless they change.
+ */
+static char *log_name, *log_rules;
+static time_t log_interval = 24 * 3600;
+static struct rule *rules;
+static int log_fd = -1;
+static time_t log_t;
+
+/* our_error FORMAT ...
+ * Report a printf-style message from the log writer on standard error. */
+void our_error(const char *fmt, ...) {
+    va_list ap;
+    fprintf(stderr, "run-with-lockfile: ");
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+}
+
+/* log_start
+ * Prepare to capture output, loading the rules if any. Returns false on
+ * error. */
+static bool log_start(void) {
+    char *cache;
+    if (!log_rules)
+        return 1;
+    cache = malloc(strlen(log_name) + sizeof ".rulecache");
+    sprintf(cache, "%s.rulecache", log_name);
+    rules = rules_read_cached(log_rules, cache);
+    free(cache);
+    return rules != NULL;
+}
+
+/* log_line LINE LEN
+ * Write the LEN-byte LINE, which ends '\n', to the current logfile, unless
+ * the rules say to drop it. */
+static void log_line(const char *line, const size_t len) {
+    int fd;
+    if (rules && rules_test(rules, line, len) == act_drop)
+        return;
+    if ((fd = reopen_logfile(log_fd, log_interval, log_name, ".%s", &log_t, 0)) != log_fd) {
+        if (log_fd != -1)
+            close(log_fd);
+        log_fd = fd;
+    }
+    if (log_fd != -1)
+        write(log_fd, line, len);
+}
+
+/* capture_open C
+ * Make a pipe for the output of a command, setting up C to read it. Returns
+ * the write end, to be passed to spawn and then closed, or -1 on error. */
+static int capture_open(struct capture *c) {
+    int pp[2];
+    memset(c, 0, sizeof *c);
+    c->c_fd = -1;
+    if (-1 == pipe2(pp, O_CLOEXEC)) {
+        fprintf(stderr, "run-with-lockfile: pipe: %s\n", strerror(errno));
+        return -1;
+    }
+    fcntl(pp[0], F_SETFL, O_NONBLOCK);
+    c->c_fd = pp[0];
+    return pp[1];
+}
+
+/* capture_read C FINAL
+ * Read what output is available on C and log any whole lines in it; an
+ * overlong line is logged in pieces. At end of file, or if FINAL is true,
+ * once nothing more is available (since the command has exited, though
+ * something it started may hold the pipe open), log any partial line and
+ * close C. The final read takes no more than the pipe can hold, that is, what
+ * was left in it when the command exited, so that something still writing
+ * to it can't keep us reading for ever. */
+static void capture_read(struct capture *c, const bool final) {
+    ssize_t n;
+    char *p, *nl;
+    long left = 0;
+
+    if (final && c->c_fd != -1 && -1 == (left = fcntl(c->c_fd, F_GETPIPE_SZ)))
+        left = 65536;
+
+    while (c->c_fd != -1) {
+        sized_buffer(&c->c_buf, &c->c_size, c->c_len + 4096);
+        n = read(c->c_fd, c->c_buf + c->c_len, c->c_size - c->c_len - 1);
+        if (n > 0) {
+            c->c_len += n;
+            for (p = c->c_buf; (nl = memchr(p, '\n', c->c_buf + c->c_len - p)); p = nl + 1)
+                log_line(p, nl + 1 - p);
+            memmove(c->c_buf, p, c->c_len -= p - c->c_buf);
+            if (c->c_len >= LINEBUF_KEEP) {
+                c->c_buf[c->c_len++] = '\n';
+                log_line(c->c_buf, c->c_len);
+                c->c_len = 0;
+            }
+            if (!final)
+                break;
+            else if ((left -= n) > 0)
+                continue;
+        } else if (n == -1 && errno == EINTR)
+            continue;
+        else if (n == -1 && errno == EAGAIN && !final)
+            break;
+
+        /* End of file, an error, or the end of the final read. */
+        if (c->c_len > 0) {
+            c->c_buf[c->c_len++] = '\n';
+            log_line(c->c_buf, c->c_len);
+        }
+        close(c->c_fd);
+        c->c_fd = -1;
+        free(c->c_buf);
+        c->c_buf = NULL;
+        c->c_len = c->c_size = 0;
+    }
+}
+#else
+/* Built without output capture, so there is never any to do. */
+static char *log_name;
+static int capture_open(struct capture *c) { return -1; }
+static void capture_read(struct capture *c, const bool final) { }
+#endif /* USE_CAPTURE */
+
+/* supervise PID SFD CAPTURE STATUS RUSAGE
+ * Wait for the child PID, which leads its own process group, to exit. Signals
+ * read from the signalfd SFD (other than SIGCHLD) are passed on to the group.
+ * If timeout is set and the child runs for longer than that, send TERM to the
+ * group and, if it is still running WAIT_AFTER_TERM seconds later, KILL. If
+ * CAPTURE is not NULL, log the child's output from it meanwhile. Sets *STATUS
+ * and *RUSAGE from wait4(2); returns true if the child timed out. */
+static bool supervise(pid_t pid, int sfd, struct capture *c, int *status, struct rusage *ru) {
+    struct timespec now, deadline;
+    struct pollfd pfd[3];
+    int pidfd = -1, stage = 0;
+
+#ifdef SYS_pidfd_open
+    pidfd = (int)syscall(SYS_pidfd_open, pid, 0);
+#endif
+    /* Without a pidfd, we learn of the child's exit from SIGCHLD on SFD. */
+    pfd[0].fd = pidfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = sfd;
+    pfd[1].events = POLLIN;
+    pfd[2].fd = c ? c->c_fd : -1;
+    pfd[2].events = POLLIN;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout;
+
+    while (wait4(pid, status, WNOHANG, ru) != pid) {
+        int ms = -1;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (timeout && stage < 2) {
+            double d = timespec_diff(&deadline, &now);
+            ms = d > 0 ? (int)(d * 1000) + 1 : 0;
+        }
+        if (0 == poll(pfd, 3, ms))
+            timeout_step(pid, command, timeout, &stage, &deadline);
+        else {
+            if (pfd[1].revents & POLLIN) {
+                struct signalfd_siginfo si;
+                if (sizeof si == read(sfd, &si, sizeof si))
+                    pass_signal(pid, &si);
+            }
+            if (pfd[2].revents) {
+                capture_read(c, 0);
+                pfd[2].fd = c->c_fd;
+            }
+            /* A chatty command mustn't keep poll from timing out. */
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (timeout && stage < 2 && timespec_diff(&deadline, &now) <= 0)
+                timeout_step(pid, command, timeout, &stage, &deadline);
+        }
+    }
+
+    if (c)
+        capture_read(c, 1);
+    if (pidfd != -1)
+        close(pidfd);
+    if (stage > 0)
+        fprintf(stderr, "run-with-lockfile: pid %d died with status %d\n", pid, *status);
+    return stage > 0;
+}
+
+/* write_report FILE LOCK STATUS TIMEDOUT WAIT WALL RUSAGE
+ * Append a line describing a run of COMMAND under LOCK to FILE, or to
+ * standard error if FILE is "-". */
+static void write_report(const char *file, const char *lock, int status, bool timed_out, double wait, double wall, const struct rusage *ru) {
+    char buf[4096];
+    int fd, n;
+    n = snprintf(buf, sizeof buf,
+                 "exit=%d timedout=%d wait=%.3f wall=%.3f user=%.3f sys=%.3f maxrss=%ld lock=%s\n",
+                 status, timed_out ? 1 : 0, wait, wall,
+                 ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6,
+                 ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6,
+                 ru->ru_maxrss, lock);
+    if (n >= (int)sizeof buf) {
+        n = sizeof buf;
+        buf[n - 1] = '\n';
+    }
+    if (0 == strcmp(file, "-"))
+        fd = 2;
+    else if (-1 == (fd = open(file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666))) {
+        fprintf(stderr, "run-with-lockfile: %s: %s\n", file, strerror(errno));
+        return;
+    }
+    /* One write, so that concurrent runs don't interleave their lines. */
+    write(fd, buf, n);
+    if (fd != 2)
+        close(fd);
+}
+
+/*
+ * Lock server. With -d SOCKET, run-with-lockfile runs as a daemon owning named
+ * locks, which clients (run-with-lockfile -s SOCKET) acquire over a unix
+ * socket; a lock is held for as long as the client keeps its connection open,
+ * so, as with fcntl locks, it is released however the client exits. The
+ * protocol is one line from the client,
+ *
+ *     LOCK WAIT NAME
+ *
+ * where WAIT is 1 to wait for the lock or 0 to fail if it is held, answered by
+ * "OK" once the lock is granted or "BUSY"; or
+ *
+ *     QUERY
+ *
+ * answered by a line "STATE NAME PID SECONDS" (tab-separated) for each
+ * client holding or waiting for a lock, after which the server closes the
+ * connection. Connections are non-blocking, and the reply is sent as the
+ * client reads it, so that one which stops reading can't hold up the server.
+ */
+
+#define LOCKNAME_MAX 1024
+
+/* struct client
+ * A connection to the lock server. */
+struct client {
+    int c_fd;
+    pid_t c_pid;
+    char c_buf[LOCKNAME_MAX + 16];
+    size_t c_len;
+    enum { st_reading, st_waiting, st_holding, st_replying } c_state;
+    char *c_name;               /* lock wanted or held */
+    struct timespec c_since;    /* when we started waiting or holding */
+    char *c_reply;              /* reply to a query, and how much is sent */
+    size_t c_replylen, c_sent;
+};
+
+static struct client *clients;
+static size_t nclients;
+
+/* elapsed SINCE
+ * Return the number of seconds since the CLOCK_MONOTONIC time SINCE. */
+static double elapsed(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/* lock_holder NAME
+ * Return the client holding the lock NAME, or NULL. */
+static struct client *lock_holder(const char *name) {
+    size_t i;
+    for (i = 0; i < nclients; ++i)
+        if (clients[i].c_state == st_holding && 0 == strcmp(clients[i].c_name, name))
+            return clients + i;
+    return NULL;
+}
+
+/* grant C
+ * Give client C the lock it asked for. */
+static void grant(struct client *c) {
+    c->c_state = st_holding;
+    clock_gettime(CLOCK_MONOTONIC, &c->c_since);
+    /* If the client has gone, it keeps the lock until we see EOF and drop
+     * it, which passes the lock on to the next waiter. */
+    if (write(c->c_fd, "OK\n", 3) != 3)
+        shutdown(c->c_fd, SHUT_RDWR);
+}
+
+/* grant_next NAME
+ * If nobody holds the lock NAME, give it to whoever has waited longest. */
+static void grant_next(const char *name) {
+    struct client *next = NULL;
+    size_t i;
+    if (lock_holder(name))
+        return;
+    for (i = 0; i < nclients; ++i) {
+        struct client *c = clients + i;
+        if (c->c_state == st_waiting && 0 == strcmp(c->c_name, name)
+            && (!next || c->c_since.tv_sec < next->c_since.tv_sec
+                || (c->c_since.tv_sec == next->c_since.tv_sec && c->c_since.tv_nsec < next->c_since.tv_nsec)))
+            next = c;
+    }
+    if (next)
+        grant(next);
+}
+
+/* drop_client I
+ * Close the connection to the Ith client, releasing any lock it holds. */
+static void drop_client(size_t i) {
+    char *name = clients[i].c_name;
+    bool held = clients[i].c_state == st_holding;
+    close(clients[i].c_fd);
+    free(clients[i].c_reply);
+    clients[i] = clients[--nclients];
+    if (held)
+        grant_next(name);
+    free(name);
+}
+
+/* query_reply C
+ * Make the state of all locks the reply to be sent to client C. */
+static void query_reply(struct client *q) {
+    FILE *fp;
+    size_t i;
+    if (!(fp = open_memstream(&q->c_reply, &q->c_replylen)))
+        return;
+    for (i = 0; i < nclients; ++i) {
+        struct client *c = clients + i;
+        if (c->c_state != st_waiting && c->c_state != st_holding)
+            continue;
+        fprintf(fp, "%s\t%s\t%d\t%.3f\n",
+                c->c_state == st_holding ? "holding" : "waiting",
+                c->c_name, (int)c->c_pid, elapsed(&c->c_since));
+    }
+    fclose(fp);
+    q->c_sent = 0;
+    q->c_state = st_replying;
+}
+
+/* reply_send C
+ * Send client C as much of its reply as it will take. Returns false once
+ * the reply has all been sent, or can't be, so the connection should be
+ * closed. */
+static bool reply_send(struct client *c) {
+    ssize_t n;
+    while (c->c_sent < c->c_replylen) {
+        if (-1 == (n = write(c->c_fd, c->c_reply + c->c_sent, c->c_replylen - c->c_sent)))
+            return errno == EAGAIN || errno == EINTR;
+        c->c_sent += n;
+    }
+    return 0;
+}
+
+/* client_request I
+ * Act on the request line from the Ith client. Returns false if the
+ * connection should now be closed. */
+static bool client_request(size_t i) {
+    struct client *c = clients + i;
+    int wait;
+    char *name;
+
+    if (0 == strcmp(c->c_buf, "QUERY")) {
+        query_reply(c);
+        return c->c_reply && reply_send(c);
+    } else if (0 != strncmp(c->c_buf, "LOCK ", 5)
+               || (c->c_buf[5] != '0' && c->c_buf[5] != '1')
+               || c->c_buf[6] != ' ' || !c->c_buf[7])
+        return 0;
+
+    wait = c->c_buf[5] == '1';
+    name = c->c_buf + 7;
+    if (lock_holder(name)) {
+        if (!wait) {
+            write(c->c_fd, "BUSY\n", 5);
+            return 0;
+        }
+        c->c_state = st_waiting;
+        c->c_name = strdup(name);
+        clock_gettime(CLOCK_MONOTONIC, &c->c_since);
+    } else {
+        c->c_name = strdup(name);
+        grant(c);
+    }
+    return 1;
 }
 
-void alarm_handler(int sig) {
+/* serve SOCKET
+ * Run a lock server listening on the unix socket SOCKET. Returns only on
+ * error. */
+static int serve(const char *sockpath) {
+    struct sockaddr_un sun = { AF_UNIX };
+    struct pollfd *pfd = NULL;
+    size_t pfdlen = 0, clientslen = 0;
+    int lfd, fd;
+
+    if (strlen(sockpath) >= sizeof sun.sun_path) {
+        fprintf(stderr, "run-with-lockfile: %s: socket path too long\n", sockpath);
+        return 101;
+    }
+    strcpy(sun.sun_path, sockpath);
+
+    /* Remove a stale socket, but not one a live server is listening on. */
+    if (-1 == (lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0))) {
+        fprintf(stderr, "run-with-lockfile: socket: %s\n", strerror(errno));
+        return 101;
+    }
+    if (0 == connect(lfd, (struct sockaddr *)&sun, sizeof sun)) {
+        fprintf(stderr, "run-with-lockfile: %s: a lock server is already running\n", sockpath);
+        return 101;
+    }
+    unlink(sockpath);
+    if (-1 == bind(lfd, (struct sockaddr *)&sun, sizeof sun) || -1 == listen(lfd, 128)) {
+        fprintf(stderr, "run-with-lockfile: %s: %s\n", sockpath, strerror(errno));
+        return 101;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    while (1) {
+        size_t i, n;
+
+        if (pfdlen < nclients + 1)
+            pfd = realloc(pfd, (pfdlen = (nclients + 1) * 2) * sizeof *pfd);
+        pfd[0].fd = lfd;
+        pfd[0].events = POLLIN;
+        for (i = 0; i < nclients; ++i) {
+            pfd[i + 1].fd = clients[i].c_fd;
+            pfd[i + 1].events = clients[i].c_state == st_replying ? POLLOUT : POLLIN;
+        }
+        n = nclients;
+        if (-1 == poll(pfd, n + 1, -1)) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "run-with-lockfile: poll: %s\n", strerror(errno));
+            return 101;
+        }
+
+        /* Work backwards, since dropping a client moves the last one into its
+         * place. */
+        for (i = n; i > 0; --i) {
+            struct client *c = clients + i - 1;
+            ssize_t r;
+            char *nl;
+            if (!pfd[i].revents)
+                continue;
+            if (c->c_state == st_replying) {
+                if (!reply_send(c))
+                    drop_client(i - 1);
+                continue;
+            }
+            if (c->c_state != st_reading
+                || 0 >= (r = read(c->c_fd, c->c_buf + c->c_len, sizeof c->c_buf - 1 - c->c_len))) {
+                if (c->c_state == st_reading && r == -1 && (errno == EAGAIN || errno == EINTR))
+                    continue;
+                /* EOF, error, or unexpected data: the client has gone. */
+                drop_client(i - 1);
+                continue;
+            }
+            c->c_len += r;
+            c->c_buf[c->c_len] = 0;
+            if ((nl = strchr(c->c_buf, '\n'))) {
+                *nl = 0;
+                if (!client_request(i - 1))
+                    drop_client(i - 1);
+            } else if (c->c_len == sizeof c->c_buf - 1)
+                drop_client(i - 1);
+        }
+
+        if ((pfd[0].revents & POLLIN)
+            && -1 != (fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC))) {
+            struct ucred cred;
+            socklen_t l = sizeof cred;
+            if (nclients == clientslen)
+                clients = realloc(clients, (clientslen = clientslen ? clientslen * 2 : 16) * sizeof *clients);
+            memset(clients + nclients, 0, sizeof *clients);
+            clients[nclients].c_fd = fd;
+            if (0 == getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &l))
+                clients[nclients].c_pid = cred.pid;
+            ++nclients;
+        }
+    }
+}
+
+/* server_connect SOCKET
+ * Return a socket connected to the lock server at SOCKET, or -1 on error. */
+static int server_connect(const char *sockpath) {
+    struct sockaddr_un sun = { AF_UNIX };
+    int fd;
+    if (strlen(sockpath) >= sizeof sun.sun_path) {
+        fprintf(stderr, "run-with-lockfile: %s: socket path too long\n", sockpath);
+        return -1;
+    }
+    strcpy(sun.sun_path, sockpath);
+    if (-1 == (fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0))
+        || -1 == connect(fd, (struct sockaddr *)&sun, sizeof sun)) {
+        fprintf(stderr, "run-with-lockfile: %s: %s\n", sockpath, strerror(errno));
+        if (fd != -1) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* server_lock SOCKET NAME WAIT FD
+ * Acquire the lock NAME from the lock server at SOCKET, waiting for it if WAIT
+ * is true. On success, sets *FD to the connection, which must be kept open
+ * while the lock is held, and returns 0; otherwise returns 100 if the lock is
+ * held and WAIT is false, 103 if the time allowed by -w ran out, or 101 on
+ * error. */
+static int server_lock(const char *sockpath, const char *name, int wait, int *fd) {
+    char buf[16];
+    ssize_t n;
+    size_t len = 0;
+
+    if (strlen(name) > LOCKNAME_MAX || strchr(name, '\n')) {
+        fprintf(stderr, "run-with-lockfile: %s: invalid lock name\n", name);
+        return 101;
+    }
+    if (-1 == (*fd = server_connect(sockpath)))
+        return 101;
+    if (dprintf(*fd, "LOCK %d %s\n", wait ? 1 : 0, name) < 0) {
+        fprintf(stderr, "run-with-lockfile: %s: %s\n", sockpath, strerror(errno));
+        close(*fd);
+        return 101;
+    }
+    while (len < sizeof buf - 1 && !memchr(buf, '\n', len)) {
+        if (-1 == (n = read(*fd, buf + len, sizeof buf - 1 - len))) {
+            if (errno == EINTR && !wait_expired)
+                continue;
+            if (!wait_expired)
+                fprintf(stderr, "run-with-lockfile: %s: %s\n", sockpath, strerror(errno));
+            close(*fd);
+            return wait_expired ? 103 : 101;
+        } else if (n == 0)
+            break;
+        len += n;
+    }
+    buf[len] = 0;
+    if (0 == strcmp(buf, "OK\n"))
+        return 0;
+    close(*fd);
+    if (0 == strcmp(buf, "BUSY\n"))
+        return 100;
+    fprintf(stderr, "run-with-lockfile: %s: unexpected reply from lock server\n", sockpath);
+    return 101;
+}
+
+/* server_query SOCKET
+ * Print the state of the locks held by the lock server at SOCKET. */
+static int server_query(const char *sockpath) {
+    char buf[4096];
+    ssize_t n;
+    int fd;
+    if (-1 == (fd = server_connect(sockpath)))
+        return 101;
+    write(fd, "QUERY\n", 6);
+    while ((n = read(fd, buf, sizeof buf)) > 0)
+        fwrite(buf, 1, n, stdout);
+    close(fd);
+    return n == 0 ? 0 : 101;
+}
+
+/* SLOT_POLL_MIN, SLOT_POLL_MAX
+ * Initial and maximum intervals, in milliseconds, between attempts to take a
+ * lock we can't wait for: one of the -c slots while they are all held, or the
+ * lock of a batch job. */
+#define SLOT_POLL_MIN 10
+#define SLOT_POLL_MAX 500
+
+/* Ways of locking FILE. An exclusive lock is a write lock on the whole file;
+ * a shared lock is a read lock on its first byte; and a counted lock is a
+ * read lock on the first byte plus a write lock on one of the following N
+ * bytes ("slots"). So shared and counted locks exclude exclusive ones, but
+ * not each other. A fair lock is an exclusive one granted in the order it was
+ * asked for; see take_ticket. */
+enum lock_mode { lock_exclusive, lock_shared, lock_counted, lock_fair };
+
+/* set_lock FD TYPE START LEN WAIT
+ * Set an fcntl lock of TYPE on the LEN bytes of FD at START (or, if LEN is 0,
+ * all those from START on), waiting for it if WAIT is true, or until the time
+ * allowed by -w runs out. Returns fcntl's result, or -1 with errno set to
+ * EINTR if the time is already up. */
+static int set_lock(int fd, short type, off_t start, off_t len, int wait) {
+    struct flock fl;
     int n;
-    struct sigaction si;
+    fl.l_type   = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start  = start;
+    fl.l_len    = len;
+    do {
+        if (wait && wait_expired) {
+            errno = EINTR;
+            return -1;
+        }
+    } while (-1 == (n = fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl)) && errno == EINTR);
+    return n;
+}
+
+/* FAIR_BASE, FAIR_RING, FAIR_SUFFIX
+ * Layout of a fair lock. The lock proper is a write lock on the bytes below
+ * FAIR_BASE, which excludes the other modes just as a whole-file lock does.
+ * The holder of ticket T keeps a write lock on the byte FAIR_BASE + 1 +
+ * T % FAIR_RING from taking its ticket until it is done with the lock. The
+ * byte at FAIR_BASE guards the ticket counter, which is kept in a file named
+ * after the lockfile with FAIR_SUFFIX appended, so as not to disturb anything
+ * the user keeps in the lockfile, nor make it look any larger; locks beyond
+ * the end of a file don't change its size. */
+#define FAIR_BASE   ((off_t)1 << 30)
+#define FAIR_RING   65536
+#define FAIR_BYTE(t) (FAIR_BASE + 1 + (off_t)((t) % FAIR_RING))
+#define FAIR_SUFFIX ".ticket"
+
+/* take_ticket FD FILE WAIT
+ * Take a fair lock on FD, open on FILE: draw the next ticket, wait for the
+ * holder of the
+ * one before to be done, then take the lock proper. Since each waiter waits
+ * only on its predecessor, they are served in ticket order; and since the
+ * ticket bytes are fcntl locks, one whose holder dies without releasing it is
+ * simply skipped. If WAIT is false, fail rather than queue behind anyone,
+ * including an exclusive holder. Returns 0, or -1 with errno set. Fairness
+ * holds only among fair lockers; an exclusive locker conflicts with the
+ * ticket bytes, so it waits until nobody is queued. */
+static int take_ticket(int fd, const char *file, int wait) {
+    uint64_t t = 0;
+    char *name;
+    int cfd = -1, e;
+
+    name = malloc(strlen(file) + sizeof FAIR_SUFFIX);
+    sprintf(name, "%s" FAIR_SUFFIX, file);
+    if (-1 == set_lock(fd, F_WRLCK, FAIR_BASE, 1, wait)) {
+        free(name);
+        return -1;
+    }
+    if (-1 == (cfd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0666)))
+        goto fail;
+    if (pread(cfd, &t, sizeof t, 0) != sizeof t)
+        t = 0;
+    ++t;
+    if (pwrite(cfd, &t, sizeof t, 0) != sizeof t
+        || -1 == set_lock(fd, F_WRLCK, FAIR_BYTE(t), 1, wait))
+        goto fail;
+    close(cfd);
+    free(name);
+    set_lock(fd, F_UNLCK, FAIR_BASE, 1, 0);
+
+    /* Ticket T is ours; wait our turn. */
+    if (-1 == set_lock(fd, F_RDLCK, FAIR_BYTE(t - 1), 1, wait))
+        return -1;
+    set_lock(fd, F_UNLCK, FAIR_BYTE(t - 1), 1, 0);
+    return set_lock(fd, F_WRLCK, 0, FAIR_BASE, wait);
+
+fail:
+    e = errno;
+    if (cfd != -1)
+        close(cfd);
+    free(name);
+    set_lock(fd, F_UNLCK, FAIR_BASE, 1, 0);
+    errno = e;
+    return -1;
+}
+
+/* open_lockfile FILE FLAGS STAT
+ * Open (perhaps create) FILE for locking, with the extra open FLAGS, and put
+ * its details in *STAT. Returns the new descriptor, or -1 after reporting an
+ * error. */
+static int open_lockfile(const char *file, int flags, struct stat *st) {
+    int fd;
+
+    if (-1 == (fd = open(file, O_RDWR | O_CREAT | flags, 0666))) {
+        fprintf(stderr, "run-with-lockfile: %s: %s\n", file, strerror(errno));
+        return -1;
+    }
+
+    /* Paranoia. */
+    if (-1 == fstat(fd, st)) {
+        fprintf(stderr, "run-with-lockfile: %s: %s\n", file, strerror(errno));
+        close(fd);
+        return -1;
+    } else if (!S_ISREG(st->st_mode)) {
+        fprintf(stderr, "run-with-lockfile: %s: is not a regular file\n", file);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* lock_fd FD FILE WAIT MODE SLOTS SLOT
+ * Lock FD, open on FILE, in the given MODE, waiting for the lock if WAIT is
+ * true. For a counted lock, SLOTS is the number of slots. On success, sets
+ * *SLOT to the slot taken, counting from 1 (or 0 if MODE is not
+ * lock_counted), and returns 0; otherwise returns 100 if the lock is held and
+ * WAIT is false, 103 if the time allowed by -w ran out, or 101 on error. */
+static int lock_fd(int fd, const char *file, int wait, enum lock_mode mode, int slots, int *slot) {
+    int n, i, delay = SLOT_POLL_MIN;
+
+    *slot = 0;
+    if (mode == lock_exclusive)
+        n = set_lock(fd, F_WRLCK, 0, 0, wait);
+    else if (mode == lock_fair)
+        n = take_ticket(fd, file, wait);
+    else if (-1 != (n = set_lock(fd, F_RDLCK, 0, 1, wait)) && mode == lock_counted) {
+        /* We can't wait for whichever slot comes free first, so try each in
+         * turn, backing off between rounds. */
+        while (1) {
+            for (i = 1; i <= slots; ++i)
+                if (-1 != (n = set_lock(fd, F_WRLCK, i, 1, 0))
+                    || (errno != EAGAIN && errno != EACCES))
+                    break;
+            if (n != -1) {
+                *slot = i;
+                break;
+            } else if (!wait || i <= slots || wait_expired)
+                break;
+            usleep(delay * 1000);
+            if ((delay *= 2) > SLOT_POLL_MAX)
+                delay = SLOT_POLL_MAX;
+        }
+    }
+
+    if (n == -1) {
+        if (wait_expired)
+            return 103;
+        else if (!wait && (errno == EAGAIN || errno == EACCES))
+            return 100;
+        else {
+            fprintf(stderr, "run-with-lockfile: %s: set lock: %s\n", file, strerror(errno));
+            return 101;
+        }
+    }
+
+    return 0;
+}
+
+/* lock_file FILE WAIT MODE SLOTS FD SLOT
+ * Open (perhaps create) and fcntl-lock FILE as lock_fd does. On success, sets
+ * *FD to the locked file and returns 0; otherwise returns as lock_fd. */
+static int lock_file(const char *file, int wait, enum lock_mode mode, int slots, int *pfd, int *slot) {
+    struct stat st;
+    int fd, n;
+
+    if (-1 == (fd = open_lockfile(file, 0, &st)))
+        return 101;
+    if ((n = lock_fd(fd, file, wait, mode, slots, slot)))
+        close(fd);
+    else
+        *pfd = fd;
+    return n;
+}
+
+/*
+ * Batch mode. With -b JOBFILE, run-with-lockfile reads a list of jobs, one per
+ * line, of the form
+ *
+ *     LOCK TIMEOUT COMMAND
+ *
+ * and runs them on a pool of workers. Each job is run as a single invocation
+ * would be, with LOCK taken as an exclusive lock (or from the lock server with
+ * -s). Since fcntl locks are held per process, and we hold them all, jobs
+ * locking the same file are serialized here, in the order they are listed;
+ * files are told apart by device and inode, found at the start, so a file may
+ * be named in different ways. Lock server names are compared as strings. A
+ * job's lockfile is open only while it is trying for or holding its lock, so
+ * that a long batch doesn't run out of descriptors; closing it can't drop
+ * another job's lock, since no other job on the same file is running then.
+ */
+
+struct job {
+    char *j_lock, *j_command;
+    int j_timeout;
+    enum { job_pending, job_running, job_done } j_state;
+    struct job *j_prev;         /* previous job with the same lock */
+    pid_t j_pid;
+    int j_fd, j_stage, j_exit;  /* j_exit is -1 if the job was never run */
+    bool j_timed_out;
+    int j_delay;                /* ms before retrying the lock; 0 if untried */
+    struct timespec j_asked, j_retry, j_start, j_end, j_deadline;
+    double j_wait;
+    struct rusage j_ru;
+    struct capture j_capture;
+};
+
+/* read_jobs FILE NJOBS
+ * Read the job list from FILE (or standard input if FILE is "-") and return
+ * an array of *NJOBS jobs, or NULL on error. Blank lines and those starting
+ * with '#' are ignored; a TIMEOUT of '-' means the value given with -t. */
+static struct job *read_jobs(const char *file, size_t *njobs) {
+    FILE *fp;
+    struct job *jobs = NULL;
+    size_t jobslen = 0, i, linelen = 0;
+    char *line = NULL, *lock, *to, *cmd, *end;
+    int lineno = 0;
+
+    if (0 == strcmp(file, "-"))
+        fp = stdin;
+    else if (!(fp = fopen(file, "r"))) {
+        fprintf(stderr, "run-with-lockfile: %s: %s\n", file, strerror(errno));
+        return NULL;
+    }
+
+    *njobs = 0;
+    while (-1 != getline(&line, &linelen, fp)) {
+        struct job *j;
+        ++lineno;
+        line[strcspn(line, "\n")] = 0;
+        if (!(lock = strtok(line, " \t")) || *lock == '#')
+            continue;
+        if (!(to = strtok(NULL, " \t")) || !(cmd = strtok(NULL, ""))
+            || !*(cmd += strspn(cmd, " \t"))) {
+            fprintf(stderr, "run-with-lockfile: %s:%d: expected LOCK TIMEOUT COMMAND\n", file, lineno);
+            goto fail;
+        }
+        if (*njobs == jobslen)
+            jobs = realloc(jobs, (jobslen = jobslen ? jobslen * 2 : 16) * sizeof *jobs);
+        j = jobs + (*njobs)++;
+        memset(j, 0, sizeof *j);
+        j->j_lock = strdup(lock);
+        j->j_command = strdup(cmd);
+        j->j_fd = -1;
+        j->j_exit = -1;
+        j->j_capture.c_fd = -1;
+        if (0 == strcmp(to, "-"))
+            j->j_timeout = timeout;
+        else if ((j->j_timeout = (int)strtol(to, &end, 10)) < 0 || *end) {
+            fprintf(stderr, "run-with-lockfile: %s:%d: bad timeout '%s'\n", file, lineno, to);
+            goto fail;
+        }
+    }
+    if (ferror(fp)) {
+        fprintf(stderr, "run-with-lockfile: %s: %s\n", file, strerror(errno));
+        goto fail;
+    }
+
+    /* Chain together the jobs on each lock. (Pointers are taken only once the
+     * array has stopped moving.) */
+    for (i = 0; i < *njobs; ++i) {
+        size_t k = i;
+        while (k-- > 0)
+            if (0 == strcmp(jobs[k].j_lock, jobs[i].j_lock)) {
+                jobs[i].j_prev = jobs + k;
+                break;
+            }
+    }
+
+    free(line);
+    if (fp != stdin)
+        fclose(fp);
+    return jobs;
+
+fail:
+    free(line);
+    free(jobs);
+    if (fp != stdin)
+        fclose(fp);
+    return NULL;
+}
+
+/* chain_job_locks JOBS NJOBS
+ * Chain together the NJOBS JOBS by the lockfile they lock rather than by its
+ * name, opening (perhaps creating) each lockfile to find out which it is. A
+ * job whose lockfile can't be opened is marked as having failed. Returns the
+ * number of such jobs. */
+static size_t chain_job_locks(struct job *jobs, size_t njobs) {
+    struct stat *st;
+    size_t i, k, nfailed = 0;
+    int fd;
+
+    st = malloc(njobs * sizeof *st);
+    for (i = 0; i < njobs; ++i) {
+        struct job *j = jobs + i;
+        j->j_prev = NULL;
+        /* No locks are held yet, so this close loses nothing. */
+        if (-1 == (fd = open_lockfile(j->j_lock, O_CLOEXEC, st + i))) {
+            j->j_exit = 101;
+            j->j_state = job_done;
+            ++nfailed;
+            continue;
+        }
+        close(fd);
+        for (k = i; k-- > 0; )
+            if (jobs[k].j_exit != 101 && st[k].st_dev == st[i].st_dev
+                && st[k].st_ino == st[i].st_ino) {
+                j->j_prev = jobs + k;
+                break;
+            }
+    }
+    free(st);
+    return nfailed;
+}
+
+/* release_job J
+ * Give up the lock held by job J, by closing its lockfile or its connection
+ * to the lock server. */
+static void release_job(struct job *j) {
+    close(j->j_fd);
+    j->j_fd = -1;
+}
+
+/* print_summary JOBS NJOBS
+ * Print a table giving the outcome and timings of each job. */
+static void print_summary(const struct job *jobs, size_t njobs) {
+    size_t i;
+    int w = 4;
+    for (i = 0; i < njobs; ++i)
+        if ((int)strlen(jobs[i].j_lock) > w)
+            w = strlen(jobs[i].j_lock);
+    printf("%4s %9s %9s %9s %9s %9s  %-*s  %s\n",
+           "exit", "wait", "wall", "user", "sys", "maxrss", w, "lock", "command");
+    for (i = 0; i < njobs; ++i) {
+        const struct job *j = jobs + i;
+        if (j->j_exit == -1)
+            printf("%4s %9s %9s %9s %9s %9s  %-*s  %s\n",
+                   "-", "-", "-", "-", "-", "-", w, j->j_lock, j->j_command);
+        else
+            printf("%4d%s%9.3f %9.3f %9.3f %9.3f %9ld  %-*s  %s\n",
+                   j->j_exit, j->j_timed_out ? "*" : " ", j->j_wait,
+                   timespec_diff(&j->j_end, &j->j_start),
+                   j->j_ru.ru_utime.tv_sec + j->j_ru.ru_utime.tv_usec / 1e6,
+                   j->j_ru.ru_stime.tv_sec + j->j_ru.ru_stime.tv_usec / 1e6,
+                   j->j_ru.ru_maxrss, w, j->j_lock, j->j_command);
+    }
+    fflush(stdout);
+}
+
+/* run_batch FILE WORKERS WAIT MAXWAIT SOCKET REPORT
+ * Run the jobs listed in FILE, at most WORKERS at once. WAIT, SOCKET and
+ * REPORT are as for a single command (-n, -s and -R); a job which has not got
+ * its lock MAXWAIT seconds (if nonzero) after it first tried fails with 103.
+ * Returns 0 if every job succeeded, otherwise the exit value of the first
+ * job, in the order listed, that failed, or 101 if some job was not run. */
+static int run_batch(const char *file, int workers, int wait, int max_wait, const char *lock_sock, const char *report) {
+    struct job *jobs, *j;
+    size_t njobs, ndone = 0, i;
+    int running = 0, sfd, n, status, slot;
+    bool stopping = false;
+    struct timespec now;
+    struct rusage ru;
+    struct pollfd *pfd;
+    sigset_t oldsigs;
+    pid_t p;
+
+    if (!(jobs = read_jobs(file, &njobs)))
+        return 101;
+    if (!lock_sock)
+        ndone = chain_job_locks(jobs, njobs);
+    if (-1 == (sfd = watch_signals(&oldsigs)))
+        return 101;
+    /* The signalfd, then the output of each running job. */
+    pfd = malloc((njobs + 1) * sizeof *pfd);
+    pfd[0].fd = sfd;
+    pfd[0].events = POLLIN;
+
+    while (ndone < njobs) {
+        int ms = -1;
+
+        /* Start whatever jobs we can, in order. */
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (i = 0; i < njobs && running < workers; ++i) {
+            j = jobs + i;
+            if (j->j_state != job_pending
+                || (j->j_prev && j->j_prev->j_state != job_done)
+                || timespec_diff(&j->j_retry, &now) > 0)
+                continue;
+            else if (stopping) {
+                j->j_state = job_done;
+                ++ndone;
+                continue;
+            }
+
+            /* Time spent queued for a worker isn't time spent waiting for
+             * the lock. */
+            if (!j->j_delay) {
+                j->j_asked = now;
+                j->j_delay = SLOT_POLL_MIN;
+            }
+            if (lock_sock)
+                n = server_lock(lock_sock, j->j_lock, 0, &j->j_fd);
+            else
+                n = lock_file(j->j_lock, 0, lock_exclusive, 0, &j->j_fd, &slot);
+            j->j_wait = timespec_diff(&now, &j->j_asked);
+            if (n == 100 && wait && max_wait && j->j_wait >= max_wait)
+                n = 103;
+            else if (n == 100 && wait) {
+                /* Back off, but not beyond the time allowed by -w. */
+                long ms = j->j_delay;
+                if (max_wait && ms > (max_wait - j->j_wait) * 1000)
+                    ms = (long)((max_wait - j->j_wait) * 1000) + 1;
+                j->j_retry = now;
+                j->j_retry.tv_sec += ms / 1000;
+                j->j_retry.tv_nsec += (ms % 1000) * 1000000L;
+                if (j->j_retry.tv_nsec >= 1000000000L) {
+                    j->j_retry.tv_nsec -= 1000000000L;
+                    ++j->j_retry.tv_sec;
+                }
+                if ((j->j_delay *= 2) > SLOT_POLL_MAX)
+                    j->j_delay = SLOT_POLL_MAX;
+                continue;
+            }
+            if (n == 0) {
+                int out = -1;
+                /* Don't let other jobs' commands inherit the lock. */
+                fcntl(j->j_fd, F_SETFD, FD_CLOEXEC);
+                j->j_start = j->j_deadline = now;
+                j->j_deadline.tv_sec += j->j_timeout;
+                if ((log_name && -1 == (out = capture_open(&j->j_capture)))
+                    || -1 == (j->j_pid = spawn(j->j_command, NULL, j->j_lock, j->j_wait, out, &oldsigs))) {
+                    release_job(j);
+                    n = 101;
+                }
+                if (out != -1)
+                    close(out);
+                if (n && j->j_capture.c_fd != -1) {
+                    close(j->j_capture.c_fd);
+                    j->j_capture.c_fd = -1;
+                }
+            }
+            if (n) {
+                j->j_exit = n;
+                j->j_end = j->j_start = now;
+                j->j_state = job_done;
+                ++ndone;
+                if (report && n != 101)
+                    write_report(report, j->j_lock, n, false, j->j_wait, 0, &j->j_ru);
+            } else {
+                j->j_state = job_running;
+                ++running;
+            }
+        }
+        if (ndone == njobs)
+            break;
+
+        /* Sleep until the next deadline or retry, or a signal. */
+        for (i = 0; i < njobs; ++i) {
+            struct timespec *t;
+            double d;
+            j = jobs + i;
+            if (j->j_state == job_running && j->j_timeout && j->j_stage < 2)
+                t = &j->j_deadline;
+            else if (j->j_state == job_pending && running < workers
+                     && (!j->j_prev || j->j_prev->j_state == job_done))
+                t = &j->j_retry;
+            else
+                continue;
+            d = timespec_diff(t, &now);
+            n = d > 0 ? (int)(d * 1000) + 1 : 0;
+            if (ms == -1 || n < ms)
+                ms = n;
+        }
+        for (i = 0, n = 1; i < njobs; ++i)
+            if (jobs[i].j_state == job_running && jobs[i].j_capture.c_fd != -1) {
+                pfd[n].fd = jobs[i].j_capture.c_fd;
+                pfd[n++].events = POLLIN;
+            }
+        if (poll(pfd, n, ms) > 0) {
+            struct signalfd_siginfo si;
+            if ((pfd[0].revents & POLLIN) && sizeof si == read(sfd, &si, sizeof si)
+                && si.ssi_signo != SIGCHLD) {
+                /* Pass the signal on, and start nothing more. */
+                for (i = 0; i < njobs; ++i)
+                    if (jobs[i].j_state == job_running)
+                        pass_signal(jobs[i].j_pid, &si);
+                stopping = true;
+            }
+            /* Jobs are visited in the same order as pfd was filled in. */
+            for (i = 0, n = 1; i < njobs; ++i)
+                if (jobs[i].j_state == job_running && jobs[i].j_capture.c_fd != -1
+                    && pfd[n++].revents)
+                    capture_read(&jobs[i].j_capture, 0);
+        }
 
-    alarm(0);
-    if(pid <= 0)
-        fprintf(stderr, "run-with-lockfile: timeout, but not killing pid %d!\n", pid);
-    else {
-        fprintf(stderr, "run-with-lockfile: %s timed out after %ds; sending TERM to pid %d and waiting for it to die...\n", command, timeout, pid);
-        kill(pid, SIGTERM);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (i = 0; i < njobs; ++i) {
+            j = jobs + i;
+            if (j->j_state == job_running && j->j_timeout && j->j_stage < 2
+                && timespec_diff(&j->j_deadline, &now) <= 0)
+                timeout_step(j->j_pid, j->j_command, j->j_timeout, &j->j_stage, &j->j_deadline);
+        }
 
-        si.sa_handler = alarm_handler_kill;
-        sigemptyset(&si.sa_mask);
-        si.sa_flags = 0;
-        sigaction(SIGALRM, &si, NULL);
+        while ((p = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+            for (i = 0; i < njobs && !(jobs[i].j_state == job_running && jobs[i].j_pid == p); ++i);
+            if (i == njobs)
+                continue;
+            j = jobs + i;
+            clock_gettime(CLOCK_MONOTONIC, &j->j_end);
+            capture_read(&j->j_capture, 1);
+            if (j->j_stage > 0)
+                fprintf(stderr, "run-with-lockfile: pid %d died with status %d\n", p, status);
+            j->j_timed_out = j->j_stage > 0;
+            j->j_exit = exit_value(status, j->j_timed_out);
+            j->j_ru = ru;
+            j->j_state = job_done;
+            release_job(j);
+            --running;
+            ++ndone;
+            if (report)
+                write_report(report, j->j_lock, j->j_exit, j->j_timed_out, j->j_wait,
+                             timespec_diff(&j->j_end, &j->j_start), &ru);
+        }
+    }
 
-        alarm(WAIT_AFTER_TERM);
+    free(pfd);
+    print_summary(jobs, njobs);
 
-        waitpid(pid, &n, 0);
+    for (i = 0, n = 0; i < njobs && !n; ++i)
+        n = jobs[i].j_exit == -1 ? 101 : jobs[i].j_exit;
+    return n;
+}
 
-        /* If we get this far, the process exited */
-        alarm(0);
-        fprintf(stderr, "run-with-lockfile: pid %d died with status %d\n", pid, n);
+/* set_mode MODE NEW
+ * Set *MODE to NEW, given by an option, unless another of -c, -r and -f has
+ * already been given. Returns false after reporting the clash if it has. */
+static bool set_mode(enum lock_mode *mode, enum lock_mode new) {
+    if (*mode != lock_exclusive && *mode != new) {
+        fprintf(stderr, "run-with-lockfile: only one of -c, -r and -f may be given\n");
+        return 0;
     }
-    exit(102);
+    *mode = new;
+    return 1;
 }
 
 int main(int argc, char *argv[]) {
@@ -95,10 +1418,18 @@ int main(int argc, char *argv[]) {
     extern int optind;
     char opt, *file, *envvar;
     int wait = 1, call_exec = 0, n;
-    int fd;
-    struct stat st;
-    struct flock fl;
-    struct sigaction si;
+    int fd, sfd, out = -1;
+    struct capture capture;
+    sigset_t oldsigs;
+    struct timespec lock_started, locked, started, finished;
+    struct rusage ru;
+    bool timed_out;
+    char *report = NULL;
+    char *lock_sock = NULL, *daemon_sock = NULL, *query_sock = NULL;
+    enum lock_mode mode = lock_exclusive;
+    int slots = 0, slot = 0;
+    char *batch = NULL;
+    int workers = 0, max_wait = 0;
 
     while ((opt = getopt(argc, argv, opts))!=-1) {
         switch (opt) {
@@ -115,12 +1446,98 @@ int main(int argc, char *argv[]) {
             case 't':
                 timeout = atoi(optarg);
                 break;
+            case 's':
+                lock_sock = optarg;
+                break;
+            case 'd':
+                daemon_sock = optarg;
+                break;
+            case 'q':
+                query_sock = optarg;
+                break;
+            case 'c':
+                if ((slots = atoi(optarg)) < 1) {
+                    fprintf(stderr, "run-with-lockfile: -c requires a positive number\n");
+                    return 101;
+                }
+                if (!set_mode(&mode, lock_counted))
+                    return 101;
+                break;
+            case 'r':
+                if (!set_mode(&mode, lock_shared))
+                    return 101;
+                break;
+            case 'f':
+                if (!set_mode(&mode, lock_fair))
+                    return 101;
+                break;
+            case 'w':
+                if ((max_wait = atoi(optarg)) < 1) {
+                    fprintf(stderr, "run-with-lockfile: -w requires a positive number\n");
+                    return 101;
+                }
+                break;
+#ifdef USE_CAPTURE
+            case 'L':
+                log_name = optarg;
+                break;
+            case 'I':
+                if (!(log_interval = parse_interval(optarg))) {
+                    fprintf(stderr, "run-with-lockfile: '%s' is not a valid interval\n", optarg);
+                    return 101;
+                }
+                break;
+            case 'P':
+                log_rules = optarg;
+                break;
+#endif
+            case 'R':
+                report = optarg;
+                break;
+            case 'b':
+                batch = optarg;
+                break;
+            case 'j':
+                if ((workers = atoi(optarg)) < 1) {
+                    fprintf(stderr, "run-with-lockfile: -j requires a positive number\n");
+                    return 101;
+                }
+                break;
             default:
                 usage(stdout);
                 return 101;
         }
     }
 
+    if (daemon_sock)
+        return serve(daemon_sock);
+    else if (query_sock)
+        return server_query(query_sock);
+
+    own_group = !isatty(0);
+
+#ifdef USE_CAPTURE
+    if (log_rules && !log_name) {
+        fprintf(stderr, "run-with-lockfile: -P requires -L\n");
+        return 101;
+    } else if (log_name && !log_start())
+        return 101;
+#endif
+
+    if (batch) {
+        if (argc != optind) {
+            fprintf(stderr, "run-with-lockfile: incorrect arguments\n");
+            usage(stderr);
+            return 101;
+        } else if (call_exec || mode != lock_exclusive) {
+            fprintf(stderr, "run-with-lockfile: -e, -c, -r and -f cannot be used with -b\n");
+            return 101;
+        }
+        if (!workers && (workers = (int)sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+            workers = 1;
+        return run_batch(batch, workers, wait, max_wait, lock_sock, report);
+    }
+
     if ((call_exec && argc - optind < 2) || (!call_exec && argc - optind != 2)) {
         fprintf(stderr, "run-with-lockfile: incorrect arguments\n");
         usage(stderr);
@@ -130,76 +1547,61 @@ int main(int argc, char *argv[]) {
     file    = argv[optind];
     command = argv[optind+1];
 
-    if (-1 == (fd = open(file, O_RDWR | O_CREAT, 0666))) {
-        fprintf(stderr, "run-with-lockfile: %s: %s\n", file, strerror(errno));
-        return 101;
-    }
-
-    /* Paranoia. */
-    if (-1 == fstat(fd, &st)) {
-        fprintf(stderr, "run-with-lockfile: %s: %s\n", file, strerror(errno));
-        return 101;
-    } else if (!S_ISREG(st.st_mode)) {
-        fprintf(stderr, "run-with-lockfile: %s: is not a regular file\n", file);
+    /* The lock server already grants locks in the order they were asked for,
+     * so -f makes no difference to it. */
+    if (lock_sock && mode != lock_exclusive && mode != lock_fair) {
+        fprintf(stderr, "run-with-lockfile: -c and -r cannot be used with -s\n");
         return 101;
     }
 
-    fl.l_type   = F_WRLCK;
-    fl.l_whence = SEEK_SET;
-    fl.l_start  = 0;
-    fl.l_len    = 0;
-
-    while (-1 == (n = fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl)) && errno == EINTR);
-
-    if (n == -1) {
-        if (!wait && (errno == EAGAIN || errno == EACCES))
-            return 100;
-        else {
-            fprintf(stderr, "run-with-lockfile: %s: set lock: %s\n", file, strerror(errno));
-            return 101;
+    clock_gettime(CLOCK_MONOTONIC, &lock_started);
+    if (max_wait && wait)
+        wait_timer(max_wait);
+    if (lock_sock)
+        n = server_lock(lock_sock, file, wait, &fd);
+    else
+        n = lock_file(file, wait, mode, slots, &fd, &slot);
+    if (max_wait && wait)
+        wait_timer(0);
+    clock_gettime(CLOCK_MONOTONIC, &locked);
+    if (n == 103)
+        fprintf(stderr, "run-with-lockfile: %s: gave up waiting for lock after %ds\n", file, max_wait);
+    if (n) {
+        if (report && n != 101) {
+            memset(&ru, 0, sizeof ru);
+            write_report(report, file, n, false, timespec_diff(&locked, &lock_started), 0, &ru);
         }
+        return n;
     }
 
-    /* Set an environment variable. */
-    envvar = malloc(strlen(file) + sizeof("LOCKFILE="));
-    sprintf(envvar, "LOCKFILE=%s", file);
-    putenv(envvar);
+    /* Set an environment variable; spawn sets LOCKFILE. */
+    if (slot) {
+        envvar = malloc(sizeof("LOCKSLOT=") + 16);
+        sprintf(envvar, "LOCKSLOT=%d", slot);
+        putenv(envvar);
+    }
         
-    if ((pid = fork()) == 0) {
-        if (call_exec) {
-            if (execv(command, &argv[optind+1]) < 0) {
-                fprintf(stderr, "run-with-lockfile: %s: %s\n", command, strerror(errno));
-                n = 101;
-            }
-        } else if (execl(SHELL_PATH, SHELL_NAME, "-c", command, NULL) < 0) {
-            if (n == -1) {
-                fprintf(stderr, "run-with-lockfile: %s: %s\n", command, strerror(errno));
-                n = 101;
-            } else if (n == 127 && errno != 0) {
-                fprintf(stderr, "run-with-lockfile: /bin/sh: %s\n", strerror(errno));
-                n = 101;
-            }
-        }
-    } else if(pid < 0) {
-        fprintf(stderr, "run-with-lockfile: fork failed: %s\n", strerror(errno));
-        n = 101;
-    } else {
-        /* Set an alarm (if -t wasn't specified, timeout will be zero
-           which disables the alarm anyway).  SA_NODEFER ensures that another
-           alarm can be set in the signal handler. */
-        si.sa_handler = alarm_handler;
-        sigemptyset(&si.sa_mask);
-        si.sa_flags = SA_NODEFER;
-        sigaction(SIGALRM, &si, NULL);
+    /* Block the signals we pass on to COMMAND, and SIGCHLD, so that we can
+     * read them from a signalfd rather than handling them. */
+    if (-1 == (sfd = watch_signals(&oldsigs)))
+        return 101;
 
-        alarm(timeout);
+    if (log_name && -1 == (out = capture_open(&capture)))
+        return 101;
 
-        if (waitpid(pid, &n, 0) != pid) {
-            fprintf(stderr, "run-with-lockfile: waitpid failed: %s\n", strerror(errno));
-            n = 101;
-        }
-        alarm(0);
-    }
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if (-1 == (pid = spawn(command, call_exec ? &argv[optind+1] : NULL, file,
+                           timespec_diff(&locked, &lock_started), out, &oldsigs)))
+        return 101;
+    if (out != -1)
+        close(out);
+    timed_out = supervise(pid, sfd, log_name ? &capture : NULL, &n, &ru);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    n = exit_value(n, timed_out);
+
+    if (report)
+        write_report(report, file, n, timed_out, timespec_diff(&locked, &lock_started),
+                     timespec_diff(&finished, &started), &ru);
 
     close(fd);
 
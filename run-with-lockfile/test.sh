@@ -0,0 +1,184 @@
+#!/bin/sh
+#
+# test.sh:
+# Scripted checks of run-with-lockfile. Run by "make check", or by hand with
+# RWL set to the binary to test.
+#
+# Copyright (c) 2005 UK Citizens Online Democracy. All rights reserved.
+# Email: chris@mysociety.org; WWW: http://www.mysociety.org/
+#
+
+RWL=${RWL:-./run-with-lockfile}
+case "$RWL" in /*) ;; *) RWL="$(pwd)/$RWL" ;; esac
+T=$(mktemp -d) || exit 1
+trap 'kill $server 2>/dev/null ; rm -rf "$T"' EXIT
+cd "$T" || exit 1
+failed=0
+
+# check DESCRIPTION COMMAND ...
+# Run COMMAND and report whether it succeeded.
+check () {
+    desc="$1"
+    shift
+    if "$@" ; then
+        echo "ok - $desc"
+    else
+        echo "FAIL - $desc"
+        failed=1
+    fi
+}
+
+# exits STATUS COMMAND ...
+# Run COMMAND, discarding its output, and succeed if it exits with STATUS.
+exits () {
+    want="$1"
+    shift
+    "$@" >/dev/null 2>&1
+    [ $? -eq "$want" ]
+}
+
+# eventually FILE
+# Succeed if FILE exists within a few seconds.
+eventually () {
+    i=0
+    while [ ! -e "$1" ] && [ $i -lt 30 ] ; do sleep 0.1 ; i=$(( i + 1 )) ; done
+    [ -e "$1" ]
+}
+
+check "-c and -r are refused together" exits 101 "$RWL" -c 2 -r lock true
+check "-c gives each holder a slot" exits 1 "$RWL" -c 2 lock 'exit $LOCKSLOT'
+
+# Against an exclusive holder, -n must fail at once even with -f, and -w must
+# give up in time, with or without -f.
+"$RWL" held "sleep 3" & holder=$!
+sleep 0.3
+check "-f -n fails against an exclusive holder" exits 100 "$RWL" -f -n held true
+check "-w gives up waiting" exits 103 "$RWL" -w 1 held true
+check "-f -w gives up waiting" exits 103 "$RWL" -f -w 1 held true
+wait $holder
+
+# A timeout must kill everything the command started, not just the command,
+# and the report must say that it timed out.
+"$RWL" -t 1 -R tm.report tm '( sleep 2 ; touch late ) & sleep 30' < /dev/null 2>/dev/null
+check "-t exits 102" [ $? -eq 102 ]
+sleep 2
+check "-t kills the command's process group" [ ! -e late ]
+check "-R reports the timeout" grep -q '^exit=102 timedout=1 .* lock=tm$' tm.report
+
+# Run from a terminal, the command must be able to read it rather than being
+# stopped as a background job.
+if command -v script > /dev/null ; then
+    ( sleep 1 ; echo hi ) | script -qec "\"$RWL\" -w 5 tty 'read x ; echo got \$x'" /dev/null > tty.out 2>&1 &
+    i=0
+    while kill -0 $! 2>/dev/null && [ $i -lt 50 ] ; do sleep 0.1 ; i=$(( i + 1 )) ; done
+    kill $! 2>/dev/null
+    check "a command run from a terminal can read it" grep -q 'got hi' tty.out
+fi
+
+# A fair lock mustn't touch the contents of the lockfile, nor make it look
+# larger; and waiters must be served in the order they asked.
+echo hello > fair
+"$RWL" -f fair true
+check "-f leaves the lockfile's contents alone" [ "$(cat fair)" = hello ]
+check "-f leaves the lockfile's size alone" [ "$(wc -c < fair)" -eq 6 ]
+"$RWL" -f fair "sleep 1" & holder=$!
+for i in 1 2 3 ; do
+    sleep 0.2
+    "$RWL" -f fair "echo $i >> order" &
+done
+wait
+check "-f serves waiters in order" [ "$(cat order)" = "$(printf '1\n2\n3')" ]
+
+# Output capture, unless built without it.
+if "$RWL" -h | grep -q -- '-L NAME' ; then
+    capture=1
+
+    # The compiled rules cache must be private, and one others could have
+    # written must be ignored (and so replaced).
+    echo 'drop secret' > cap.rules
+    "$RWL" -L cap -P cap.rules lk 'echo public ; echo secret'
+    check "rules cache is created private" [ "$(stat -c %a cap.rulecache)" = 600 ]
+    chmod 666 cap.rulecache
+    "$RWL" -L cap -P cap.rules lk 'echo again' 2>/dev/null
+    check "a rules cache writable by others is replaced" [ "$(stat -c %a cap.rulecache)" = 600 ]
+    check "captured output is filtered" [ "$(cat cap.[0-9]*)" = "$(printf 'public\nagain')" ]
+
+    # -I rotates the capture logfiles.
+    while [ $(( $(date +%s) % 2 )) -ne 0 ] ; do sleep 0.1 ; done
+    "$RWL" -L rot -I 2 lk 'echo one ; sleep 2.5 ; echo two'
+    set -- rot.[0-9]*
+    check "-I rotates captured output" \
+        [ $# -eq 2 ] && [ "$(cat "$1")" = one ] && [ "$(cat "$2")" = two ]
+
+    # Batch jobs' output is captured, whole lines at a time.
+    printf 'a 0 echo one\nb 0 echo two\n' > jobs
+    "$RWL" -j 2 -L bat -b jobs > /dev/null
+    check "batch output is captured" [ "$(sort bat.[0-9]*)" = "$(printf 'one\ntwo')" ]
+
+    # Something the command leaves writing to its output mustn't keep us
+    # reading after the command exits.
+    ( "$RWL" -L bg lk 'yes & echo started' ; touch bg.done ) &
+    check "capture stops when the command exits" eventually bg.done
+    check "capture keeps output from before the command exits" grep -q started bg.[0-9]*
+fi
+
+# Batch jobs locking the same file run one at a time, however it is named;
+# and time spent queued for a worker doesn't count as waiting for the lock.
+cat > jobs <<EOF
+lk 0 touch busy ; sleep 1 ; rm busy
+./lk 0 test ! -e busy
+EOF
+check "batch jobs on one file run in turn" exits 0 "$RWL" -j 2 -b jobs
+# Lockfiles are opened only as their jobs run, so a batch may name more
+# files than we may have open at once.
+for i in $(seq 1 40) ; do echo "many.$i 0 true" ; done > jobs
+check "batch jobs on more files than descriptors" \
+    exits 0 sh -c 'ulimit -n 16 && exec "$1" -j 2 $2 -b jobs' sh "$RWL" "${capture:+-L many}"
+cat > jobs <<EOF
+lk 0 sleep 1
+other 0 true
+EOF
+"$RWL" -j 1 -R report -b jobs > /dev/null
+check "batch lock wait excludes queueing" \
+    awk '/lock=other$/ { sub(/.*wait=/, ""); exit !($1 < 0.5) }' report
+
+# When a waiter dies just as the lock is passed to it, the lock server must
+# pass the lock on to the next waiter. Clients are numbered by the server in
+# order of connection, and the one dropped is replaced by the last, so the
+# waiter which dies is arranged to come before the holder; the server is
+# stopped so that it sees both go at once.
+"$RWL" -d "$T/sock" & server=$!
+sleep 0.5
+"$RWL" -s "$T/sock" z "sleep 30" & z=$!
+sleep 0.3
+"$RWL" -s "$T/sock" x "sleep 30" & holder=$!
+sleep 0.3
+"$RWL" -s "$T/sock" x "touch dead" & waiter=$!
+sleep 0.3
+kill $z ; wait $z
+sleep 0.3
+"$RWL" -s "$T/sock" x "touch next" & next=$!
+sleep 0.3
+kill -STOP $server
+kill -KILL $waiter
+kill $holder ; wait $holder
+kill -CONT $server
+check "lock server passes the lock on past a dead waiter" eventually next
+kill $next 2>/dev/null
+
+# A -q client which stops reading its reply mustn't hold up the lock server;
+# with enough long lock names, the reply won't fit in the socket buffer.
+perl -MIO::Socket::UNIX -e '
+    for (1 .. 400) {
+        push @c, IO::Socket::UNIX->new(Peer => $ARGV[0]) or die "$ARGV[0]: $!\n";
+        print { $c[-1] } "LOCK 1 ", "y" x 1000, "\n";
+    }
+    $q = IO::Socket::UNIX->new(Peer => $ARGV[0]) or die "$ARGV[0]: $!\n";
+    print $q "QUERY\n";
+    sleep 30;' "$T/sock" & stuck=$!
+sleep 1
+check "lock server isn't held up by a query client which doesn't read" \
+    exits 0 "$RWL" -w 3 -s "$T/sock" free true
+kill $stuck
+
+exit $failed